@@ -99,3 +99,108 @@ uint32_t MurmurHash3_x86_32 ( const void * key, int len, uint32_t seed)
 } 
 
 //-----------------------------------------------------------------------------
+// Multi-key variant - each AVX2 lane hashes one key
+
+#include <string.h>
+#include <immintrin.h>
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+TARGET_AVX2 static inline __m256i rotl32_x8 ( __m256i x, int r )
+{
+		return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+TARGET_AVX2 static inline __m256i getblock32_x8 ( const void * const * keys, int offset )
+{
+		uint32_t lanes[8];
+		for(int i = 0; i < 8; i++)
+		{
+				memcpy(&lanes[i], (const uint8_t *) keys[i] + offset, sizeof(uint32_t));
+		}
+		return _mm256_loadu_si256((const __m256i *) lanes);
+}
+
+TARGET_AVX2 static void MurmurHash3_x86_32_avx2 ( const void * const * keys, int len, uint32_t seed, uint32_t * out )
+{
+		const int nblocks = len / 4;
+
+		__m256i h1 = _mm256_set1_epi32(seed);
+
+		const __m256i c1 = _mm256_set1_epi32(0xcc9e2d51);
+		const __m256i c2 = _mm256_set1_epi32(0x1b873593);
+		const __m256i c5 = _mm256_set1_epi32(5);
+		const __m256i c6 = _mm256_set1_epi32(0xe6546b64);
+
+		//----------
+		// body
+
+		for(int i = 0; i < nblocks; i++)
+		{
+				__m256i k1 = getblock32_x8(keys, i*4);
+
+				k1 = _mm256_mullo_epi32(k1, c1);
+				k1 = rotl32_x8(k1, 15);
+				k1 = _mm256_mullo_epi32(k1, c2);
+
+				h1 = _mm256_xor_si256(h1, k1);
+				h1 = rotl32_x8(h1, 13);
+				h1 = _mm256_add_epi32(_mm256_mullo_epi32(h1, c5), c6);
+		}
+
+		//----------
+		// tail
+
+		if(len & 3)
+		{
+				uint32_t lanes[8];
+				for(int i = 0; i < 8; i++)
+				{
+						const uint8_t * tail = (const uint8_t *) keys[i] + nblocks*4;
+						uint32_t k1 = 0;
+						switch(len & 3)
+						{
+								case 3: k1 ^= tail[2] << 16;
+								case 2: k1 ^= tail[1] << 8;
+								case 1: k1 ^= tail[0];
+						};
+						lanes[i] = k1;
+				}
+
+				__m256i k1 = _mm256_loadu_si256((const __m256i *) lanes);
+				k1 = _mm256_mullo_epi32(k1, c1);
+				k1 = rotl32_x8(k1, 15);
+				k1 = _mm256_mullo_epi32(k1, c2);
+				h1 = _mm256_xor_si256(h1, k1);
+		}
+
+		//----------
+		// finalization
+
+		h1 = _mm256_xor_si256(h1, _mm256_set1_epi32(len));
+
+		h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+		h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32(0x85ebca6b));
+		h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 13));
+		h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32(0xc2b2ae35));
+		h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+
+		_mm256_storeu_si256((__m256i *) out, h1);
+}
+
+void MurmurHash3_x86_32_x8 ( const void * const * keys, int len, uint32_t seed, uint32_t * out )
+{
+		static const bool avx2 = __builtin_cpu_supports("avx2");
+		if(avx2)
+		{
+				MurmurHash3_x86_32_avx2(keys, len, seed, out);
+				return;
+		}
+
+		for(int i = 0; i < 8; i++)
+		{
+				out[i] = MurmurHash3_x86_32(keys[i], len, seed);
+		}
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,228 @@
+#include "MurmurHash.h"
+#include "cms.h"
+#include "batch_topk.h"
+#include "checkpointer.h"
+
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <thread>
+
+// Number of Classes
+const size_t K = 8;
+
+// Size of Count-Sketch Array - 1536 blocks of 4 KB
+const size_t D = (1 << 16) - 1;
+
+// Number of Arrays in Count-Sketch
+const size_t N = 3;
+
+// Size of Top-K Heap
+const int TOPK = 255;
+
+// Distinct features
+const int FEATURES = 5000;
+
+// Features trained between checkpoints - a light round changes a few blocks, a heavy round more than half of them
+const size_t LIGHT = 10;
+const size_t HEAVY = 3000;
+
+typedef CMS<N> sketch_t;
+typedef BatchTopK<int, TOPK> heap_t;
+
+// Table and trainer state as of the last checkpoint
+struct expected_t
+{
+		std::string table;
+		std::string state;
+};
+
+/*
+   Train random features - each one updates the sketch and the heap, as in coarse_mission_softmax
+ */
+void train(sketch_t& sketch, heap_t& heap, std::mt19937& gen, const size_t count)
+{
+		std::uniform_int_distribution<int> feature(0, FEATURES - 1);
+		std::normal_distribution<float> weight(0.0, 1.0);
+
+		float gradient[K];
+		for(size_t idx = 0; idx < count; ++idx)
+		{
+				for(size_t cdx = 0; cdx < K; ++cdx)
+				{
+						gradient[cdx] = weight(gen);
+				}
+
+				const int key = feature(gen);
+				hc<N> cache;
+				sketch.hash(&key, sizeof(key), cache);
+				heap.push(key, sketch.cms_update_norm(cache, gradient, -0.1));
+				heap.step();
+		}
+}
+
+/*
+   Train for a number of rounds with a checkpoint after each one - the first checkpoint writes the base
+   @param prefix - path prefix of the checkpoint files
+   @param rounds - features trained before each checkpoint
+   @param previous - if set, a hard link to the base as it was before the last checkpoint
+   @return the table and heap as of the last checkpoint
+ */
+expected_t run(const std::string& prefix, const std::vector<size_t>& rounds, const char* previous = nullptr)
+{
+		std::mt19937 gen(1234);
+		sketch_t sketch(K, D);
+		heap_t heap;
+		heap_log<int> log;
+		heap_mirror<int> mirror;
+		heap.track();
+
+		expected_t result;
+		checkpointer<sketch_t> saver(sketch, prefix, std::chrono::milliseconds(5));
+		for(size_t round = 0; round < rounds.size(); ++round)
+		{
+				train(sketch, heap, gen, rounds[round]);
+				if(previous != nullptr && round + 1 == rounds.size())
+				{
+						link((prefix + ".base").c_str(), previous);
+				}
+
+				// Poll between batches until the background thread takes the state
+				bool copied = false;
+				while(!copied)
+				{
+						saver.poll([&]
+						{
+								heap.collect(log);
+								copied = true;
+						},
+						[&](std::ostream& out)
+						{
+								mirror.apply(log);
+								mirror.save(out);
+						});
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+		}
+
+		// Nothing changes after the last poll, and stop() finishes the checkpoint in progress
+		saver.stop();
+		result.table.assign((const char*) sketch.table(), sketch.table_bytes());
+		std::ostringstream out;
+		heap.save(out);
+		result.state = out.str();
+		return result;
+}
+
+/*
+   Restore a checkpoint into a new sketch and compare it with the state as of the last checkpoint
+   @param expected - table and trainer state, or nullptr if the delta must be ignored
+   @return number of mismatches
+ */
+size_t check(const char* name, const std::string& prefix, const expected_t* expected)
+{
+		sketch_t sketch(K, D);
+		bool loaded = false;
+		std::string state;
+		const bool status = checkpointer<sketch_t>::restore(sketch, prefix, [&](std::istream& in)
+		{
+				std::ostringstream copy;
+				copy << in.rdbuf();
+				state = copy.str();
+				loaded = true;
+
+				heap_t heap;
+				std::istringstream again(state);
+				loaded = heap.load(again);
+		});
+
+		size_t errors = status ? 0 : 1;
+		if(expected == nullptr)
+		{
+				errors += loaded ? 1 : 0;
+		}
+		else
+		{
+				errors += (loaded && state == expected->state) ? 0 : 1;
+				errors += (status && memcmp(sketch.table(), expected->table.data(), expected->table.size()) == 0) ? 0 : 1;
+		}
+		std::cout << name << "\t" << errors << std::endl;
+		return errors;
+}
+
+bool exists(const std::string& filename)
+{
+		return access(filename.c_str(), F_OK) == 0;
+}
+
+void remove_files(const std::string& prefix)
+{
+		for(const char* suffix : {".base", ".base.next", ".base.old", ".delta"})
+		{
+				unlink((prefix + suffix).c_str());
+		}
+}
+
+/*
+   Check that restore() reproduces the table and trainer state of the last checkpoint byte for byte,
+   including after a crash at each step of a rebase
+   ./checkpoint_check - prints the number of mismatches for each case, exits with 1 on any mismatch
+ */
+int main()
+{
+		const std::string prefix = "checkpoint_check";
+		const std::string base = prefix + ".base";
+		const std::string next = prefix + ".base.next";
+		const std::string old = prefix + ".base.old";
+
+		// The checkpoint timings go to std::cerr
+		std::ostringstream timings;
+		std::streambuf* cerrbuf = std::cerr.rdbuf(timings.rdbuf());
+
+		size_t errors = 0;
+		file_stamp before, after;
+
+		// Base, then two deltas against it
+		remove_files(prefix);
+		expected_t expected = run(prefix, {HEAVY, LIGHT, LIGHT}, old.c_str());
+		errors += (stamp_file(old.c_str(), before) && stamp_file(base.c_str(), after) && before == after) ? 0 : 1;
+		errors += check("delta", prefix, &expected);
+
+		// A rebase stopped before its delta - the unfinished .base.next is ignored
+		{
+				std::ofstream partial(next, std::ios::binary);
+				partial.write(expected.table.data(), expected.table.size() / 2);
+		}
+		errors += check("next without delta", prefix, &expected);
+
+		// A rebase stopped after its delta but before the rename - restore() finishes it
+		remove_files(prefix);
+		expected = run(prefix, {HEAVY, LIGHT, HEAVY}, old.c_str());
+		errors += (stamp_file(old.c_str(), before) && stamp_file(base.c_str(), after) && !(before == after)) ? 0 : 1;
+		rename(base.c_str(), next.c_str());
+		rename(old.c_str(), base.c_str());
+		errors += check("next with delta", prefix, &expected);
+		errors += (!exists(next)) ? 0 : 1;
+		errors += check("rebased", prefix, &expected);
+
+		// A delta that matches neither file is never applied
+		remove_files(prefix);
+		run(prefix, {HEAVY, LIGHT, HEAVY}, old.c_str());
+		rename(base.c_str(), next.c_str());
+		rename(old.c_str(), base.c_str());
+		unlink(next.c_str());
+		errors += check("stale delta", prefix, nullptr);
+
+		remove_files(prefix);
+		std::cerr.rdbuf(cerrbuf);
+		std::cout << ((errors == 0) ? "OK" : "FAILED") << std::endl;
+		return (errors == 0) ? 0 : 1;
+}
@@ -1,13 +1,22 @@
 #include "MurmurHash.h"
-#include "fast_parser.h"
+#include "mmap_parser.h"
 #include "mp_queue.h"
-#include "cms.h"
+#include "hash_cache.h"
+#include "bcms.h"
 #include "topk.h"
+#include "batch_topk.h"
+#include "feature_key.h"
+#include "checkpointer.h"
+#include "progress.h"
+#include "feature_set.h"
+#include "frozen_model.h"
 #include "util.h"
 
 #include <stdlib.h>
 #include <vector>
 #include <utility>
+#include <memory>
+#include <type_traits>
 #include <iostream>
 #include <climits>
 #include <random>
@@ -33,12 +42,38 @@ const size_t D = (1 << 24) - 1;
 // Number of Arrays in Count-Sketch
 const size_t N = 3;
 
+// Count-Sketch Layout and Counter Format
+typedef CMS<N> sketch_t;
+
 // Learning Rate
 const float LR = 1e-1;
 
 // Length of String Feature Representation
 const size_t LEN = 12;
 
+// Weight Memory
+const mem_config MEMORY(page_policy::transparent, numa_policy::interleave);
+
+// Feature Selection Score
+const merge_score SCORE = merge_score::max;
+
+// Feature Key
+typedef key16_t feature_t;
+
+// Keep Feature Names for fingerprint keys
+const bool KEEP_NAMES = false;
+
+// Top-K Heap
+typedef BatchTopK<feature_t, TOPK> heap_t;
+
+// Seconds between Background Checkpoints (0 disables them) - resume with --resume as the first argument
+const size_t CHECKPOINT_SECONDS = 0;
+// Checkpoint File Prefix
+const char* CHECKPOINT = "coarse_mission";
+
+// Frozen Model File for mission_inference (nullptr disables it)
+const char* MODEL = "coarse_mission.model";
+
 /***** End of Hyper-Parameters *****/
 
 const size_t AVX = 8;
@@ -49,45 +84,78 @@ const size_t CNT = (MOD == 0) ? DIV : DIV+1;
 // Number of threads for parallel data preprocessing
 const size_t THREADS = 6;
 
+// Number of parser threads splitting each input file
+const size_t PARSERS = 4;
+
+// Number of threads hashing features between the parsers and the workers
+const size_t HASHERS = 4;
+
 // Maximum number of features for an example
 const size_t MAX_FEATURES = 378;
 
 typedef std::pair<int, float> fp_t;
-typedef std::vector<data_t> x_t;
-typedef std::vector<TopK<data_t, TOPK>> tk_t;
+typedef std::vector<heap_t> tk_t;
+typedef feature_set<feature_t> fs_t;
+
+// Example as a span of the input file - tokenized by the hash stage
+typedef line_t x_t;
+
+// Example with precomputed hash indices - output of the hashing stage
+struct example_t
+{
+		size_t label;
+		std::vector<feature_t> keys;
+		std::vector<hc<N>> cache;
+		position_t where;
+};
 
 // Serialize Output
 std::mutex mtx;
-std::array<std::array<hc<N>, MAX_FEATURES>, THREADS> caches;
-std::array<std::array<bool, MAX_FEATURES>, THREADS> active_sets;
+std::array<std::array<feature_t, MAX_FEATURES>, THREADS> features;
+
+// Feature strings for fingerprint keys - see KEEP_NAMES, saved with the checkpoints
+key_names names;
+
+// Background checkpointer - see CHECKPOINT_SECONDS
+checkpointer<sketch_t>* saver = nullptr;
 
-void producer(fast_parser& p, mp_queue<x_t>& q)
+// Resume offsets of the file being trained - saved with the checkpoints
+progress trained;
+
+// Heap changes and offsets copied between batches - the background checkpointer applies the changes to its mirrors of the heaps and writes them
+std::vector<heap_log<feature_t>> logs;
+std::vector<heap_mirror<feature_t>> mirrors;
+progress saved;
+
+/*
+   Parse Stage - Split the input file into lines
+ */
+void producer(parallel_parser& p, mp_queue<x_t>& q)
 {
-		for(std::vector<data_t> x = p.read(' '); p; x = p.read(' '))
+		p.lines([&](const x_t& line)
 		{
-				q.enqueue(x);
-		}
+				q.enqueue(line);
+		});
+		q.close();
 		//std::cout << "Finished Reading" << std::endl;
 }
 
-float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
+/*
+   Train or evaluate one example
+   @param label - class index for the example
+   @param cache - cached hash indices and signs for each feature
+   @param keys - feature representation for each feature
+   @param size - number of features
+   @param selected - merged Top-K features used for evaluation
+ */
+float process(sketch_t& sketch, tk_t& topk, const fs_t& selected, const size_t label, const hc<N>* cache, const feature_t* keys, const size_t size, bool train)
 {
 		const int tid = omp_get_thread_num();
-
-		const size_t label = atoi(x[0].data()) - 1;
 		assert(label >= 0 && label < K);
 
 		// TopK Heap
 		auto& tk = topk[tid];
 
-		// Cache Feature Hashing Indices
-		std::array<hc<N>, MAX_FEATURES>& cache = caches[tid];
-		for(size_t idx = 2; idx < x.size(); ++idx)
-		{
-				const void * key_ptr = (const void *) x[idx].data();
-				sketch.hash(key_ptr, LEN, cache[idx-2]);
-		}
-
 		__m256 logits[CNT];
 		for(size_t cdx = 0; cdx < CNT; ++cdx)
 		{
@@ -96,57 +164,29 @@ float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
 
 		if(train)
 		{
-				for(size_t idx = 2; idx < x.size(); ++idx)
+				for(size_t idx = 0; idx < size; ++idx)
 				{
-						const data_t& key = x[idx];
-						if(tk.find(key))
+						if(tk.find(keys[idx]))
 						{
-								auto& item = cache[idx-2];
-								for(size_t cdx = 0; cdx < CNT; ++cdx)
-								{
-										__m256 weight = sketch.cms_retrieve(item, cdx);
-										logits[cdx] = _mm256_add_ps(logits[cdx], weight);
-								}
+								sketch.cms_retrieve(cache[idx], (float*) logits);
 						}
 				}
 		}
 		else
 		{
-				// Active Set Boolean Array
-				std::array<bool, MAX_FEATURES>& AS = active_sets[tid];
-				AS.fill(false);
-
-				// Visit each feature only once
-				// Accumulate features across each independent top-k heap
-				for(auto& tk : topk)
+				// One lookup per feature in the heaps merged after training
+				for(size_t idx = 0; idx < size; ++idx)
 				{
-						for(size_t idx = 2; idx < x.size(); ++idx)
+						if(selected.find(keys[idx]))
 						{
-								const data_t& key = x[idx];
-								AS[idx-2] = tk.find(key);	
-						}
-				}
-
-				for(size_t idx = 0; idx < AS.size(); ++idx)
-				{
-						if(AS[idx])
-						{
-								auto& item = cache[idx+2];
-								for(size_t cdx = 0; cdx < CNT; ++cdx)
-								{
-										__m256 weight = sketch.cms_retrieve(item, cdx);
-										logits[cdx] = _mm256_add_ps(logits[cdx], weight);
-								}
+								sketch.cms_retrieve(cache[idx], (float*) logits);
 						}
 				}
 		}
 
-		float max_value = 0;
+		// Softmax + Cross-Entropy - logits become the gradient
 		uint32_t argmax = 0;
-		maximum(logits, K, max_value, argmax);
-		partition(logits, CNT, K, max_value);
-		float loss = std::log(get(logits, label) + 1e-10);
-		update(logits, label, -1.0);
+		float loss = softmax_loss(logits, CNT, K, label, argmax);
 
 		if(!train)
 		{
@@ -156,63 +196,88 @@ float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
 				return loss;
 		}
 
-		// Apply Gradient Update
-		__m256 LR_AVX = _mm256_set1_ps(-LR);
-		for(size_t idx = 2; idx < x.size(); ++idx)
+		// Apply Gradient Update + Update TopK Heap - L1 Norm for each class feature vector
+		for(size_t idx = 0; idx < size; ++idx)
 		{
-				auto& item = cache[idx-2];
-				for(size_t cdx = 0; cdx < CNT; ++cdx)
-				{
-						__m256 update = _mm256_mul_ps(LR_AVX, logits[cdx]);
-						sketch.cms_update(item, cdx, update);
-				}
+				float value = sketch.cms_update_norm(cache[idx], (const float*) logits, -LR);
+				tk.push(keys[idx], value);
 		}
+		tk.step();
+		return loss;
+}
 
-		// Update TopK Heap - L1 Norm for each class feature vector
-		for(size_t idx = 2; idx < x.size(); ++idx)
-		{
-				auto& item = cache[idx-2];
-
-				__m256 l1_norm = _mm256_set1_ps(0);
-				for(size_t cdx = 0; cdx < CNT; ++cdx)
-				{
-						__m256 weight = sketch.cms_retrieve(item, cdx);
-						l1_norm = _mm256_add_ps(l1_norm, my_abs(weight));
-				}
+float process(sketch_t& sketch, tk_t& topk, const fs_t& selected, const example_t& x, bool train)
+{
+		return process(sketch, topk, selected, x.label, x.cache.data(), x.keys.data(), x.cache.size(), train);
+}
 
-				float value = 0.0;
-				for(size_t pos = 0; pos < AVX; ++pos)
-				{
-						value += l1_norm[pos];
-				}
+float process(sketch_t& sketch, tk_t& topk, const fs_t& selected, const cached_example<hc<N>>& x, bool train)
+{
+		const int tid = omp_get_thread_num();
 
-				const data_t& key = x[idx];
-				tk.push(key, value);
+		// The cache holds the same keys the hasher builds for training
+		std::array<feature_t, MAX_FEATURES>& keys = features[tid];
+		for(size_t idx = 0; idx < x.size; ++idx)
+		{
+				keys[idx] = x.key<feature_t>(idx);
 		}
-		return loss;
+		return process(sketch, topk, selected, x.label, x.features, keys.data(), x.size, train);
 }
 
-void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool train)
+/*
+   Hash Stage - Convert tokenized rows into examples with cached hash indices
+ */
+void hasher(sketch_t& sketch, mp_queue<x_t>& rows, mp_queue<example_t>& q)
 {
 		std::vector<x_t> items;
-		size_t cnt = 0;
-		while(p || q)
+		std::vector<token_t> x;
+		std::vector<const void*> key_ptrs;
+		std::vector<char> pad;
+		while(rows.retrieve(items))
 		{
-				if(!q.full() && p)
+				for(const x_t& item : items)
 				{
-						std::this_thread::sleep_for (std::chrono::seconds(1));
-						continue;
+						tokenize(item, ' ', x);
+						example_t example;
+						example.where = item.where;
+						example.label = to_int(x[0]) - 1;
+						example.keys.resize(x.size()-2);
+						example.cache.resize(x.size()-2);
+						key_ptrs.resize(x.size()-2);
+						pad.resize((x.size()-2) * LEN);
+						for(size_t idx = 2; idx < x.size(); ++idx)
+						{
+								key_ptrs[idx-2] = key_bytes(x[idx], LEN, &pad[(idx-2) * LEN]);
+								example.keys[idx-2] = to_key<feature_t>(x[idx]);
+								if(KEEP_NAMES)
+								{
+										names.add(example.keys[idx-2], x[idx]);
+								}
+						}
+						sketch.hash(key_ptrs.data(), LEN, example.cache.data(), key_ptrs.size());
+						q.enqueue(std::move(example));
 				}
+				items.clear();
+		}
+}
 
-				// Retrieve items from multiprocess queue
-				q.retrieve(items);
+/*
+   Train Stage - Only reads and writes the sketch
+ */
+void consumer(sketch_t& sketch, tk_t& topk, const fs_t& selected, mp_queue<example_t>& q, bool train)
+{
+		std::vector<example_t> items;
+		size_t cnt = 0;
+		// Retrieve batches from multiprocess queue until the producers are finished
+		while(q.retrieve(items))
+		{
 				cnt += items.size();
 
 				float loss = 0.0;
                 #pragma omp parallel for num_threads(THREADS)
 				for(size_t cdx = 0; cdx < items.size(); ++cdx)
 				{
-						loss += process(sketch, topk, items[cdx], train);
+						loss += process(sketch, topk, selected, items[cdx], train);
 				}
 
 				// Debug
@@ -220,41 +285,268 @@ void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool
 				{
 						float avg_loss = -loss / items.size();
 						std::cout << cnt << "\t" << avg_loss << std::endl;
+
+						for(const example_t& item : items)
+						{
+								trained.complete(item.where);
+						}
 				}
 				items.clear();
+
+				// The workers are idle between batches - copy the heap changes for a pending checkpoint
+				if(train && saver)
+				{
+						saver->poll([&]
+						{
+								saved = trained;
+								#pragma omp parallel for num_threads(THREADS)
+								for(size_t tdx = 0; tdx < topk.size(); ++tdx)
+								{
+										topk[tdx].collect(logs[tdx]);
+								}
+						},
+						[](std::ostream& out)
+						{
+								saved.save(out);
+								for(size_t tdx = 0; tdx < mirrors.size(); ++tdx)
+								{
+										mirrors[tdx].apply(logs[tdx]);
+										mirrors[tdx].save(out);
+								}
+								names.save(out);
+						});
+				}
 		}
 		//std::cout << "Finished Consumer" << std::endl;
 }
 
+/*
+   Hash every example of a file once and store the result in a binary cache
+   @param input - VW data file
+   @param output - Hash Cache File
+   @return true if the cache was written
+ */
+bool convert(sketch_t& sketch, const char* input, const char* output)
+{
+		hash_cache_writer<hc<N>> writer(output, sizeof(feature_t), sketch.signature(), input);
+		parallel_parser p(input, PARSERS);
+		p.run([&](const row_t& x)
+		{
+				const size_t size = x.size()-2;
+				std::vector<hc<N>> cache(size);
+				std::vector<feature_t> keys(size);
+				std::vector<const void*> key_ptrs(size);
+				std::vector<char> pad(size * LEN);
+				for(size_t idx = 0; idx < size; ++idx)
+				{
+						key_ptrs[idx] = key_bytes(x[idx+2], LEN, &pad[idx * LEN]);
+						keys[idx] = to_key<feature_t>(x[idx+2]);
+				}
+				sketch.hash(key_ptrs.data(), LEN, cache.data(), size);
+
+				mtx.lock();
+				writer.write(to_int(x[0]) - 1, cache.data(), (const char*) keys.data(), size);
+				mtx.unlock();
+		});
+		return writer.finish();
+}
+
+/*
+   Parse -> Hash -> Train pipeline over one file
+   @param filename - VW data file
+   @param from - resume offset of each parser range
+ */
+void pipeline(sketch_t& sketch, tk_t& topk, const fs_t& selected, const char* filename, bool train, const std::vector<size_t>& from = std::vector<size_t>())
+{
+		parallel_parser p(filename, PARSERS, from);
+		mp_queue<x_t> rows(1000);
+		mp_queue<example_t> q(10000);
+
+		std::thread pr([&] { producer(p, rows); });
+		std::vector<std::thread> hr;
+		for(size_t idx = 0; idx < HASHERS; ++idx)
+		{
+				hr.emplace_back([&] { hasher(sketch, rows, q); });
+		}
+		std::thread cr([&] { consumer(sketch, topk, selected, q, train); });
+
+		pr.join();
+		for(auto& worker : hr)
+		{
+				worker.join();
+		}
+		q.close();
+		cr.join();
+}
+
+/*
+   Materialize the median weights of the selected features into a frozen model
+   The sketch is indexed by the feature strings, so features without a known string are left out
+   @param filename - Frozen Model File
+ */
+void freeze(sketch_t& sketch, const fs_t& selected, const char* filename)
+{
+		std::vector<feature_t> keys;
+		for(size_t idx = 0; idx < selected.size(); ++idx)
+		{
+				if(names.contains(selected.key(idx)))
+				{
+						keys.push_back(selected.key(idx));
+				}
+		}
+
+		if(keys.size() != selected.size())
+		{
+				std::cerr << "Frozen Model: " << selected.size() - keys.size() << " selected features without names are left out" << std::endl;
+		}
+		if(keys.empty())
+		{
+				std::cerr << "Frozen Model Skipped: no selected features" << std::endl;
+				return;
+		}
+
+		frozen_model<feature_t> model;
+		const bool built = model.build(keys, K, [&](const feature_t& key, float* row)
+		{
+				const std::string name = names(key);
+				char pad[LEN];
+				const void* ptr = key_bytes({name.data(), name.size()}, LEN, pad);
+
+				hc<N> cache;
+				sketch.hash(&ptr, LEN, &cache, 1);
+				sketch.cms_retrieve(cache, row);
+		}, THREADS);
+
+		if(!built || !model.save(filename))
+		{
+				std::cerr << "Frozen Model Failure: " << filename << std::endl;
+				return;
+		}
+
+		const double MB = 1 << 20;
+		std::cout << "Frozen Model (MB):\t" << model.memory() / MB << "\t" << "Sketch (MB):\t" << sketch.table_bytes() / MB << std::endl;
+}
+
+void evaluate(sketch_t& sketch, tk_t& topk, const fs_t& selected, const hash_cache_reader<hc<N>>& cache)
+{
+		#pragma omp parallel for num_threads(THREADS)
+		for(size_t idx = 0; idx < cache.size(); ++idx)
+		{
+				process(sketch, topk, selected, cache[idx], false);
+		}
+}
+
 int main(int argc, char* argv[])
 {
-		CMS<N> sketch(K, D);
-		mp_queue<x_t> q(10000);
+		// --resume continues from the last background checkpoint
+		const bool resume = (argc > 1 && std::string(argv[1]) == "--resume");
+		if(resume)
+		{
+				++argv;
+				--argc;
+		}
+
+		sketch_t sketch(K, D, MEMORY);
 		tk_t topk(THREADS);
+		fs_t selected;
+
+		int first = 1;
+		std::vector<size_t> from;
+		if(resume)
+		{
+				bool status = false;
+				const bool loaded = checkpointer<sketch_t>::restore(sketch, CHECKPOINT, [&](std::istream& in)
+				{
+						status = trained.load(in);
+						for(auto& tk : topk)
+						{
+								status = status && tk.load(in);
+						}
+						status = status && names.load(in);
+				});
+
+				if(!loaded || !status || trained.offsets().size() != PARSERS)
+				{
+						std::cerr << "Resume Failure: " << CHECKPOINT << std::endl;
+						return 1;
+				}
+				first = trained.current();
+				from = trained.offsets();
+				std::cout << "Resume:\t" << first << std::endl;
+		}
+
+		std::unique_ptr<checkpointer<sketch_t>> background;
+		if(CHECKPOINT_SECONDS > 0)
+		{
+				// The mirrors start with the restored heaps, so the pauses only copy what training changes
+				logs.resize(topk.size());
+				mirrors.resize(topk.size());
+				for(size_t idx = 0; idx < topk.size(); ++idx)
+				{
+						topk[idx].track();
+						topk[idx].collect(logs[idx]);
+						mirrors[idx].apply(logs[idx]);
+				}
+				background.reset(new checkpointer<sketch_t>(sketch, CHECKPOINT, std::chrono::seconds(CHECKPOINT_SECONDS)));
+				saver = background.get();
+		}
 
-		for(int iter = 1; iter < argc-1; ++iter)
+		// Parse and hash the test file once - every validation pass reads the cache
+		const std::string cache_file = std::string(argv[argc-1]) + ".cache";
+		if(!hash_cache_reader<hc<N>>(cache_file.c_str(), sizeof(feature_t), sketch.signature(), argv[argc-1]) && !convert(sketch, argv[argc-1], cache_file.c_str()))
+		{
+				std::cerr << "Hash Cache Failure: " << cache_file << std::endl;
+				return 1;
+		}
+		hash_cache_reader<hc<N>> test_cache(cache_file.c_str(), sizeof(feature_t), sketch.signature(), argv[argc-1]);
+
+		for(int iter = first; iter < argc-1; ++iter)
 		{
 				std::cout << "Epoch:\t" << iter << std::endl;
 
-				fast_parser train_p(argv[iter]);
-				std::thread train_pr([&] { producer(train_p, q); });
-				std::thread train_cr([&] { consumer(sketch, topk, train_p, q, true); });
-				train_pr.join();
-				train_cr.join();
+				trained.start(iter, PARSERS, from);
+				pipeline(sketch, topk, selected, argv[iter], true, from);
+				from.clear();
+
+				// Merge the per-thread heaps into one ranked feature set
+				for(auto& tk : topk)
+				{
+						tk.flush();
+				}
+				selected.merge(topk, TOPK, SCORE, THREADS);
+				selected.save(("r" + std::to_string(iter) + ".features").c_str(), names);
 
 				std::cout << "Validation:\t" << iter << std::endl;
 				std::ofstream out("r" + std::to_string(iter) + ".pred");
 				std::streambuf* coutbuf = std::cout.rdbuf(); //save old buf
 				std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
 
-				fast_parser test_p(argv[argc-1]);
-				std::thread test_pr([&] { producer(test_p, q); });
-				std::thread test_cr([&] { consumer(sketch, topk, test_p, q, false); });
-				test_pr.join();
-				test_cr.join();
+				evaluate(sketch, topk, selected, test_cache);
 
 				std::cout.rdbuf(coutbuf); //redirect std::cout to original
 		}
 
+		if(MODEL != nullptr)
+		{
+				// A resumed run with no epoch left to train still has the heaps of the checkpoint
+				if(selected.size() == 0)
+				{
+						for(auto& tk : topk)
+						{
+								tk.flush();
+						}
+						selected.merge(topk, TOPK, SCORE, THREADS);
+				}
+
+				if(std::is_same<feature_t, fingerprint_t>::value && !KEEP_NAMES)
+				{
+						std::cerr << "Frozen Model Skipped: fingerprint keys need KEEP_NAMES" << std::endl;
+				}
+				else
+				{
+						freeze(sketch, selected, MODEL);
+				}
+		}
+
 		return 0;
 }
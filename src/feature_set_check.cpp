@@ -0,0 +1,119 @@
+#include "MurmurHash.h"
+#include "topk.h"
+#include "batch_topk.h"
+#include "feature_set.h"
+
+#include <stdlib.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+// Size of each Top-K Heap
+const int TOPK = 255;
+
+// Number of heaps, e.g. one per training thread
+const size_t HEAPS = 6;
+
+// Number of random features pushed to each heap
+const size_t PUSHES = 4000;
+
+// Distinct features - small enough that the heaps share many of them
+const int FEATURES = 1000;
+
+/*
+   Brute-force reference - union of every heap in a map, ranked by a full sort
+   @return the key of each selected feature, best first
+ */
+template<typename heap_t>
+std::vector<int> brute_force(const std::vector<heap_t>& heaps, const size_t limit, const merge_score score)
+{
+		std::map<int, std::pair<float, float>> scores;
+		for(const heap_t& heap : heaps)
+		{
+				heap.for_each([&](const int key, const float value)
+				{
+						const float magnitude = my_abs(value);
+						auto result = scores.insert(std::make_pair(key, std::make_pair(magnitude, 0.0f)));
+						result.first->second.first = std::max(result.first->second.first, magnitude);
+						result.first->second.second += magnitude;
+				});
+		}
+
+		std::vector<std::pair<float, int>> ranked;
+		for(const auto& item : scores)
+		{
+				const float value = (score == merge_score::max) ? item.second.first : item.second.second;
+				ranked.push_back(std::make_pair(-value, item.first));
+		}
+		std::sort(ranked.begin(), ranked.end());
+
+		std::vector<int> result;
+		for(size_t idx = 0; idx < ranked.size() && idx < limit; ++idx)
+		{
+				result.push_back(ranked[idx].second);
+		}
+		return result;
+}
+
+/*
+   Fill random heaps, merge them and compare the ranking with the brute-force union
+   @return number of mismatched ranks
+ */
+template<typename heap_t>
+size_t check(std::mt19937& gen, const size_t limit, const merge_score score, const int threads)
+{
+		std::uniform_int_distribution<int> feature(0, FEATURES - 1);
+		std::normal_distribution<float> weight(0.0, 1.0);
+
+		std::vector<heap_t> heaps(HEAPS);
+		for(heap_t& heap : heaps)
+		{
+				for(size_t idx = 0; idx < PUSHES; ++idx)
+				{
+						heap.push(feature(gen), weight(gen));
+				}
+				heap.flush();
+		}
+
+		feature_set<int> selected;
+		selected.merge(heaps, limit, score, threads);
+		const std::vector<int> expected = brute_force(heaps, limit, score);
+
+		size_t errors = (selected.size() == expected.size()) ? 0 : 1;
+		for(size_t rank = 0; rank < expected.size() && rank < selected.size(); ++rank)
+		{
+				if(selected.key(rank) != expected[rank] || !selected.find(expected[rank]))
+				{
+						++errors;
+				}
+		}
+		return errors;
+}
+
+/*
+   Check feature_set::merge against a brute-force ranking on random heaps
+   ./feature_set_check - prints the number of mismatched ranks for each configuration, exits with 1 on any mismatch
+ */
+int main()
+{
+		std::mt19937 gen(1234);
+		size_t errors = 0;
+		for(const merge_score score : {merge_score::max, merge_score::sum})
+		{
+				for(const size_t limit : {size_t(10), size_t(TOPK), size_t(HEAPS * TOPK)})
+				{
+						for(const int threads : {1, 4})
+						{
+								const size_t topk = check<TopK<int, TOPK>>(gen, limit, score, threads);
+								const size_t batch = check<BatchTopK<int, TOPK>>(gen, limit, score, threads);
+								std::cout << ((score == merge_score::max) ? "max" : "sum") << "\t" << limit << "\t" << threads
+										<< "\tTopK " << topk << "\tBatchTopK " << batch << std::endl;
+								errors += topk + batch;
+						}
+				}
+		}
+		std::cout << ((errors == 0) ? "OK" : "FAILED") << std::endl;
+		return (errors == 0) ? 0 : 1;
+}
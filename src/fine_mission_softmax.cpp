@@ -1,12 +1,18 @@
 #include "MurmurHash.h"
-#include "fast_parser.h"
+#include "mmap_parser.h"
 #include "mp_queue.h"
-#include "cms.h"
+#include "bcms.h"
 #include "topk.h"
+#include "batch_topk.h"
+#include "feature_key.h"
+#include "intern_table.h"
+#include "checkpointer.h"
+#include "progress.h"
 
 #include <stdlib.h>
 #include <vector>
 #include <utility>
+#include <memory>
 #include <iostream>
 #include <climits>
 #include <random>
@@ -32,12 +38,29 @@ const size_t D = (1 << 24) - 1;
 // Number of Arrays in Count-Sketch
 const size_t N = 3;
 
+// Count-Sketch Layout and Counter Format
+typedef CMS<N> sketch_t;
+
 // Learning Rate
 const float LR = 1e-2;
 
 // Length of String Feature Representation
 const size_t LEN = 12;
 
+// Weight Memory
+const mem_config MEMORY(page_policy::transparent, numa_policy::interleave);
+
+// Feature Key
+typedef key16_t feature_t;
+
+// Top-K Heap - keyed by interned feature ids
+typedef BatchTopK<uint32_t, TOPK> heap_t;
+
+// Seconds between Background Checkpoints (0 disables them) - resume with --resume as the first argument
+const size_t CHECKPOINT_SECONDS = 0;
+// Checkpoint File Prefix
+const char* CHECKPOINT = "fine_mission";
+
 /***** End of Hyper-Parameters *****/
 
 const size_t AVX = 8;
@@ -46,40 +69,66 @@ const size_t MOD = K % AVX;
 const size_t CNT = (MOD == 0) ? DIV : DIV+1;
 
 typedef std::pair<int, float> fp_t;
-typedef std::vector<data_t> x_t;
-typedef std::vector<TopK<data_t, TOPK>> tk_t;
+typedef std::vector<heap_t> tk_t;
+
+// Example as a span of the input file - tokenized by the hash stage
+typedef line_t x_t;
+
+// Example with precomputed hash indices - output of the hashing stage
+struct example_t
+{
+		size_t label;
+		std::vector<uint32_t> ids;
+		std::vector<hc<N>> cache;
+		position_t where;
+};
+
+// Feature => 32-bit id, shared by all per-class heaps
+intern_table<feature_t> interned;
+
+// Background checkpointer - see CHECKPOINT_SECONDS
+checkpointer<sketch_t>* saver = nullptr;
+
+// Resume offsets of the training file - saved with the checkpoints
+progress trained;
+
+// Heap changes and offsets copied between batches - the background checkpointer applies the changes to its mirrors of the heaps and writes them
+std::vector<heap_log<uint32_t>> logs;
+std::vector<heap_mirror<uint32_t>> mirrors;
+progress saved;
 
 // Serialize Output
 std::mutex mtx;
 
 // Number of threads for parallel data preprocessing
 const size_t THREADS = 16;
+// Number of parser threads splitting each input file
+const size_t PARSERS = 4;
+// Number of threads hashing features between the parsers and the workers
+const size_t HASHERS = 4;
 // Maximum number of features for an example
 const size_t MAX_FEATURES = 378;
-std::array<std::array<hc<N>, MAX_FEATURES>, THREADS> caches;
 
-void producer(fast_parser& p, mp_queue<x_t>& q)
+/*
+   Parse Stage - Split the input file into lines
+ */
+void producer(parallel_parser& p, mp_queue<x_t>& q)
 {
-		for(std::vector<data_t> x = p.read(' '); p; x = p.read(' '))
+		p.lines([&](const x_t& line)
 		{
-				q.enqueue(x);
-		}
+				q.enqueue(line);
+		});
+		q.close();
 		//std::cout << "Finished Reading" << std::endl;
 }
 
-float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
+float process(sketch_t& sketch, tk_t& topk, const example_t& x, bool train)
 {
-		const size_t label = atoi(x[0].data()) - 1;
+		const size_t label = x.label;
 		assert(label >= 0 && label < K);
 
-		const int tid = omp_get_thread_num();
-		std::array<hc<N>, MAX_FEATURES>& cache = caches[tid];
-		#pragma omp parallel for num_threads(10)
-		for(size_t idx = 2; idx < x.size(); ++idx)
-		{
-				const void * key_ptr = (const void *) x[idx].data();
-				sketch.hash(key_ptr, LEN, cache[idx-2]);
-		}
+		const std::vector<hc<N>>& cache = x.cache;
+		const std::vector<uint32_t>& ids = x.ids;
 
 		__m256 logits[CNT];
 		for(size_t cdx = 0; cdx < CNT; ++cdx)
@@ -120,20 +169,16 @@ float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
 				#pragma omp parallel for num_threads(10)
 				for(size_t class_idx = 0; class_idx < K; ++class_idx)
 				{
-						for(size_t idx = 2; idx < x.size(); ++idx)
+						for(const uint32_t id : ids)
 						{
-								const data_t& key = x[idx];
-								update(logits, class_idx, topk[class_idx][key]);
+								update(logits, class_idx, topk[class_idx][id]);
 						}
 				}
 		}
 
-		float max_value = 0;
+		// Softmax + Cross-Entropy - logits become the gradient
 		uint32_t argmax = 0;
-		maximum(logits, K, max_value, argmax);
-		partition(logits, CNT, K, max_value);
-		float loss = std::log(get(logits, label) + 1e-10);
-		update(logits, label, -1.0);
+		float loss = softmax_loss(logits, CNT, K, label, argmax);
 
 		if(!train)
 		{
@@ -144,46 +189,71 @@ float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
 		}
 
 		// Apply Gradient Update
-		__m256 LR_AVX = _mm256_set1_ps(-LR);
 		#pragma omp parallel for num_threads(10)
-		for(size_t idx = 2; idx < x.size(); ++idx)
+		for(size_t idx = 0; idx < cache.size(); ++idx)
 		{
-				auto& item = cache[idx-2];
-				for(size_t cdx = 0; cdx < CNT; ++cdx)
-				{
-						__m256 update = _mm256_mul_ps(LR_AVX, logits[cdx]);
-						sketch.cms_update(item, cdx, update);
-				}
+				sketch.cms_update(cache[idx], (const float*) logits, -LR);
 		}
 
 		// Update TopK Heap
 		#pragma omp parallel for num_threads(10)
 		for(size_t class_idx = 0; class_idx < K; ++class_idx)
 		{
-				for(size_t idx = 0; idx < MAX_FEATURES; ++idx)
+				for(size_t idx = 0; idx < ids.size(); ++idx)
 				{
-						const data_t& str = x[idx+2];
 						float value = sketch.cms_retrieve_single(cache[idx], class_idx);
-						topk[class_idx].push(str, my_abs(value));
+						topk[class_idx].push(ids[idx], my_abs(value));
 				}
+				topk[class_idx].step();
 		}
 		return loss;
 }
 
-void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool train)
+/*
+   Hash Stage - Convert tokenized rows into examples with cached hash indices
+   Training features are interned - test features that were never trained get the NONE id, which no heap contains
+ */
+void hasher(sketch_t& sketch, mp_queue<x_t>& rows, mp_queue<example_t>& q, bool train)
 {
 		std::vector<x_t> items;
-		size_t cnt = 0;
-		while(p || q)
+		std::vector<token_t> x;
+		std::vector<const void*> key_ptrs;
+		std::vector<char> pad;
+		while(rows.retrieve(items))
 		{
-				if(!q.full() && p)
+				for(const x_t& item : items)
 				{
-						std::this_thread::sleep_for (std::chrono::seconds(1));
-						continue;
+						tokenize(item, ' ', x);
+						example_t example;
+						example.where = item.where;
+						example.label = to_int(x[0]) - 1;
+						example.ids.resize(x.size()-2);
+						example.cache.resize(x.size()-2);
+						key_ptrs.resize(x.size()-2);
+						pad.resize((x.size()-2) * LEN);
+						for(size_t idx = 2; idx < x.size(); ++idx)
+						{
+								key_ptrs[idx-2] = key_bytes(x[idx], LEN, &pad[(idx-2) * LEN]);
+								const feature_t key = to_key<feature_t>(x[idx]);
+								example.ids[idx-2] = train ? interned.intern(key) : interned.find(key);
+						}
+						sketch.hash(key_ptrs.data(), LEN, example.cache.data(), key_ptrs.size());
+						q.enqueue(std::move(example));
 				}
+				items.clear();
+		}
+}
 
-				// Retrieve items from multiprocess queue
-				q.retrieve(items);
+/*
+   Train Stage - Only reads and writes the sketch
+ */
+void consumer(sketch_t& sketch, tk_t& topk, mp_queue<example_t>& q, bool train)
+{
+		std::vector<example_t> items;
+		size_t cnt = 0;
+		// Retrieve batches from multiprocess queue until the producers are finished
+		while(q.retrieve(items))
+		{
 				cnt += items.size();
 
 				float loss = 0.0;
@@ -197,29 +267,138 @@ void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool
 				{
 						float avg_loss = -loss / items.size();
 						std::cout << cnt << "\t" << avg_loss << std::endl;
+
+						for(const example_t& item : items)
+						{
+								trained.complete(item.where);
+						}
 				}
 				items.clear();
+
+				// Copy the heap changes for a pending checkpoint - the interned features only grow and are saved after the copy,
+				// so every id in a heap is included
+				if(train && saver)
+				{
+						saver->poll([&]
+						{
+								saved = trained;
+								#pragma omp parallel for num_threads(10)
+								for(size_t class_idx = 0; class_idx < topk.size(); ++class_idx)
+								{
+										topk[class_idx].collect(logs[class_idx]);
+								}
+						},
+						[](std::ostream& out)
+						{
+								saved.save(out);
+								for(size_t class_idx = 0; class_idx < mirrors.size(); ++class_idx)
+								{
+										mirrors[class_idx].apply(logs[class_idx]);
+										mirrors[class_idx].save(out);
+								}
+								interned.save(out);
+						});
+				}
 		}
 		//std::cout << "Finished Consumer" << std::endl;
 }
 
+/*
+   Parse -> Hash -> Train pipeline over one file
+   @param filename - VW data file
+   @param from - resume offset of each parser range
+ */
+void pipeline(sketch_t& sketch, tk_t& topk, const char* filename, bool train, const std::vector<size_t>& from = std::vector<size_t>())
+{
+		parallel_parser p(filename, PARSERS, from);
+		mp_queue<x_t> rows(1000);
+		mp_queue<example_t> q(10000);
+
+		std::thread pr([&] { producer(p, rows); });
+		std::vector<std::thread> hr;
+		for(size_t idx = 0; idx < HASHERS; ++idx)
+		{
+				hr.emplace_back([&] { hasher(sketch, rows, q, train); });
+		}
+		std::thread cr([&] { consumer(sketch, topk, q, train); });
+
+		pr.join();
+		for(auto& worker : hr)
+		{
+				worker.join();
+		}
+		q.close();
+		cr.join();
+}
+
 int main(int argc, char* argv[])
 {
-		CMS<N> sketch(K, D);
-		mp_queue<x_t> q(10000);
+		// --resume continues from the last background checkpoint
+		const bool resume = (argc > 1 && std::string(argv[1]) == "--resume");
+		if(resume)
+		{
+				++argv;
+				--argc;
+		}
+
+		sketch_t sketch(K, D, MEMORY);
 		tk_t topk(K);
 
-		fast_parser train_p(argv[1]);
-		std::thread train_pr([&] { producer(train_p, q); });
-		std::thread train_cr([&] { consumer(sketch, topk, train_p, q, true); });
-		train_pr.join();
-		train_cr.join();
-
-		fast_parser test_p(argv[2]);
-		std::thread test_pr([&] { producer(test_p, q); });
-		std::thread test_cr([&] { consumer(sketch, topk, test_p, q, false); });
-		test_pr.join();
-		test_cr.join();
+		std::vector<size_t> from;
+		if(resume)
+		{
+				bool status = false;
+				const bool loaded = checkpointer<sketch_t>::restore(sketch, CHECKPOINT, [&](std::istream& in)
+				{
+						status = trained.load(in);
+						for(auto& tk : topk)
+						{
+								status = status && tk.load(in);
+						}
+						status = status && interned.load(in);
+				});
+
+				if(!loaded || !status || trained.offsets().size() != PARSERS)
+				{
+						std::cerr << "Resume Failure: " << CHECKPOINT << std::endl;
+						return 1;
+				}
+				from = trained.offsets();
+		}
+
+		std::unique_ptr<checkpointer<sketch_t>> background;
+		if(CHECKPOINT_SECONDS > 0)
+		{
+				// The mirrors start with the restored heaps, so the pauses only copy what training changes
+				logs.resize(topk.size());
+				mirrors.resize(topk.size());
+				for(size_t idx = 0; idx < topk.size(); ++idx)
+				{
+						topk[idx].track();
+						topk[idx].collect(logs[idx]);
+						mirrors[idx].apply(logs[idx]);
+				}
+				background.reset(new checkpointer<sketch_t>(sketch, CHECKPOINT, std::chrono::seconds(CHECKPOINT_SECONDS)));
+				saver = background.get();
+		}
+
+		trained.start(1, PARSERS, from);
+		pipeline(sketch, topk, argv[1], true, from);
+		size_t entries = 0;
+		for(auto& tk : topk)
+		{
+				tk.flush();
+				entries += tk.size();
+		}
+
+		// Key memory of the heaps - the original TopK<data_t> kept three copies of the 32-byte string per entry
+		// (slot array and two maps), the interned heaps keep two ids per entry plus every training feature once
+		const double MB = 1 << 20;
+		const double string_keys = 3.0 * entries * sizeof(data_t) / MB;
+		const double interned_keys = (2.0 * entries * sizeof(uint32_t) + interned.memory()) / MB;
+		std::cout << "Interned Features:\t" << interned.size() << "\t" << "Heap Entries:\t" << entries << std::endl;
+		std::cout << "Key Memory (MB) - data_t Heaps:\t" << string_keys << "\t" << "Interned:\t" << interned_keys << std::endl;
+		pipeline(sketch, topk, argv[2], false);
 
 		return 0;
 }
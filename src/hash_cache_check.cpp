@@ -0,0 +1,176 @@
+#include "MurmurHash.h"
+#include "mmap_parser.h"
+#include "hash_cache.h"
+#include "feature_key.h"
+
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <set>
+#include <iostream>
+#include <fstream>
+#include <random>
+
+// Length of String Feature Representation - as in the mains
+const size_t LEN = 12;
+
+// Number of examples in the data file
+const size_t EXAMPLES = 500;
+
+// Features per example
+const size_t FEATURES = 20;
+
+// Longest feature - tokens are shorter than, as long as and longer than LEN
+const size_t MAX_LEN = 3 * LEN;
+
+// Data file and its cache
+const char* DATA = "hash_cache_check.vw";
+const char* CACHE = "hash_cache_check.vw.cache";
+
+/*
+   Write a VW data file with random features that often share their first LEN bytes
+   @return number of features written
+ */
+size_t write_data(std::mt19937& gen)
+{
+		std::uniform_int_distribution<size_t> length(1, MAX_LEN);
+		std::uniform_int_distribution<int> letter(0, 3);
+		const char ACGT[] = "ACGT";
+
+		std::ofstream out(DATA);
+		size_t count = 0;
+		for(size_t idx = 0; idx < EXAMPLES; ++idx)
+		{
+				out << (idx % 7) + 1 << " |";
+				for(size_t fdx = 0; fdx < FEATURES; ++fdx)
+				{
+						// Same prefix for every feature of an example, so truncated keys would collide
+						std::string feature(LEN, ACGT[idx % 4]);
+						feature.resize(length(gen), 'A');
+						for(size_t pos = LEN; pos < feature.size(); ++pos)
+						{
+								feature[pos] = ACGT[letter(gen)];
+						}
+						out << " " << feature;
+						++count;
+				}
+				out << "\n";
+		}
+		return count;
+}
+
+/*
+   Cache the data file as convert() does, then compare each cached key with the key the hasher trains with
+   @return number of mismatched keys
+ */
+template<typename key_t>
+size_t check()
+{
+		unlink(CACHE);
+		{
+				hash_cache_writer<uint32_t> writer(CACHE, sizeof(key_t), 0, DATA);
+				parallel_parser p(DATA, 1);
+				p.run([&](const row_t& x)
+				{
+						const size_t size = x.size()-2;
+						std::vector<uint32_t> cache(size, 0);
+						std::vector<key_t> keys(size);
+						for(size_t idx = 0; idx < size; ++idx)
+						{
+								keys[idx] = to_key<key_t>(x[idx+2]);
+						}
+						writer.write(to_int(x[0]) - 1, cache.data(), (const char*) keys.data(), size);
+				});
+				if(!writer.finish())
+				{
+						return EXAMPLES * FEATURES;
+				}
+		}
+
+		hash_cache_reader<uint32_t> cache(CACHE, sizeof(key_t), 0, DATA);
+		if(!cache || cache.size() != EXAMPLES)
+		{
+				return EXAMPLES * FEATURES;
+		}
+
+		// Training keys - one parser range keeps the examples in file order
+		size_t errors = 0;
+		size_t example = 0;
+		std::vector<token_t> x;
+		parallel_parser p(DATA, 1);
+		p.lines([&](const line_t& line)
+		{
+				tokenize(line, ' ', x);
+				const cached_example<uint32_t> item = cache[example++];
+				if(item.size != x.size()-2 || item.label != (uint32_t) (to_int(x[0]) - 1))
+				{
+						errors += FEATURES;
+						return;
+				}
+				for(size_t idx = 2; idx < x.size(); ++idx)
+				{
+						if(!(item.key<key_t>(idx-2) == to_key<key_t>(x[idx])))
+						{
+								++errors;
+						}
+				}
+		});
+		return errors;
+}
+
+/*
+   @return number of distinct fingerprints in the cache, which equals the number of distinct features
+ */
+size_t distinct()
+{
+		hash_cache_reader<uint32_t> cache(CACHE, sizeof(fingerprint_t), 0, DATA);
+		std::set<uint64_t> keys;
+		for(size_t idx = 0; idx < cache.size(); ++idx)
+		{
+				const cached_example<uint32_t> item = cache[idx];
+				for(size_t fdx = 0; fdx < item.size; ++fdx)
+				{
+						keys.insert(item.key<fingerprint_t>(fdx).value);
+				}
+		}
+		return keys.size();
+}
+
+/*
+   Check that the hash cache returns the keys the hasher trains with for tokens of any length
+   ./hash_cache_check - prints the number of mismatched keys for each key format, exits with 1 on any mismatch
+ */
+int main()
+{
+		std::mt19937 gen(1234);
+		write_data(gen);
+
+		// Distinct features, read back from the data file
+		std::set<std::string> features;
+		{
+				std::vector<token_t> x;
+				parallel_parser p(DATA, 1);
+				p.lines([&](const line_t& line)
+				{
+						tokenize(line, ' ', x);
+						for(size_t idx = 2; idx < x.size(); ++idx)
+						{
+								features.insert(std::string(x[idx].ptr, x[idx].len));
+						}
+				});
+		}
+
+		const size_t data = check<data_t>();
+		const size_t key16 = check<key16_t>();
+		const size_t fingerprint = check<fingerprint_t>();
+		const size_t unique = distinct();
+		std::cout << "data_t " << data << "\tkey16_t " << key16 << "\tfingerprint_t " << fingerprint << std::endl;
+		std::cout << "features " << features.size() << "\tfingerprints " << unique << std::endl;
+
+		unlink(CACHE);
+		unlink(DATA);
+
+		const bool ok = (data + key16 + fingerprint == 0) && (unique == features.size());
+		std::cout << (ok ? "OK" : "FAILED") << std::endl;
+		return ok ? 0 : 1;
+}
@@ -14,6 +14,10 @@
 
 uint32_t MurmurHash3_x86_32  ( const void * key, int len, uint32_t seed );
 
+// Hash 8 keys of the same length at once using AVX2 when available
+// Bit-identical to calling MurmurHash3_x86_32 on each key
+void MurmurHash3_x86_32_x8 ( const void * const * keys, int len, uint32_t seed, uint32_t * out );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
@@ -0,0 +1,412 @@
+#ifndef CMS_ML_BATCH_TOPK_H_
+#define CMS_ML_BATCH_TOPK_H_
+
+#include "topk.h"
+#include "flat_table.h"
+#include "bloom_filter.h"
+#include "heap_log.h"
+#include "util.h"
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <assert.h>
+
+/*
+   Batched Top-K - Same interface as TopK, but once the set is full new features are admitted in batches instead of one heap operation per push
+   push() updates features already in the set in place, admits new features directly while the set is filling,
+   and afterwards appends new features that beat the threshold to a buffer
+   When the buffer fills, or every M examples counted by step(), flush() merges it with the set and keeps the N largest magnitudes
+   by partial selection (nth_element), so the O(N) selection runs once per batch of candidates
+   Features keep their slot across flushes - an admitted feature takes the slot of an evicted one, so a checkpoint log only holds the changed slots
+   find() and operator[] reflect the set as of the last flush - call flush() before reading the final set
+   minimum() is exact after a flush and lowered by in-place updates in between, so it never exceeds the smallest magnitude in the set
+   @param B - number of buffered candidates
+   @param M - number of examples between flushes, 0 flushes only when the buffer fills
+ */
+template <typename key_t, int N, int B = N / 4 + 1, int M = 0>
+class BatchTopK
+{
+		private:
+				typedef typename flat_table<key_t>::entry entry;
+
+				struct candidate
+				{
+						key_t key;
+						uint64_t hash;
+						float value;
+				};
+
+				// keys / hashes - slot => feature
+				// dict - feature => <value, slot>
+				// buffer - features waiting for the next flush
+				// changed - bitmap of the slots changed since the last collect(), empty unless tracked
+				// logged - buffered features already copied by collect()
+				std::vector<key_t> keys;
+				std::vector<uint64_t> hashes;
+				flat_table<key_t> dict;
+				bloom_filter filter;
+				std::vector<candidate> buffer;
+				float threshold;
+				size_t examples;
+				std::vector<uint64_t> changed;
+				size_t logged;
+
+				void mark(const size_t slot)
+				{
+						if(!changed.empty())
+						{
+								changed[slot / 64] |= 1ULL << (slot % 64);
+						}
+				}
+
+				const entry* lookup(const key_t& key) const
+				{
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						return filter.contains(hash) ? dict.find(key, hash) : nullptr;
+				}
+
+				// Rebuild the filter from the current features - makes room for twice as many
+				void rebuild()
+				{
+						filter.reset(2 * keys.size());
+						for(const uint64_t hash : hashes)
+						{
+								filter.insert(hash);
+						}
+				}
+
+				// The threshold is the smallest magnitude in the full set
+				void update_threshold()
+				{
+						threshold = FLT_MAX;
+						for(size_t idx = 0; idx < keys.size(); ++idx)
+						{
+								threshold = std::min(threshold, my_abs(dict.find(keys[idx], hashes[idx])->value));
+						}
+				}
+
+				/*
+				   Rebuild the dict and filter for the features in keys
+				   @param values - signed value for each slot
+				 */
+				void index(const std::vector<float>& values)
+				{
+						// Reuse the table - once the set is full, it holds at most N + B features until the next flush
+						dict.clear();
+						dict.reserve(full() ? (size_t) N + B : keys.size());
+						for(size_t idx = 0; idx < keys.size(); ++idx)
+						{
+								entry& result = dict.insert(keys[idx], hashes[idx]);
+								result.value = values[idx];
+								result.slot = idx;
+						}
+						rebuild();
+				}
+
+		public:
+				BatchTopK() : threshold(0.0), examples(0), logged(0)
+				{
+						keys.reserve(N);
+						hashes.reserve(N);
+						buffer.reserve(B);
+				}
+
+				/*
+				   @param key - feature representation
+				   @return the corresponding value for the feature if present in Top-K set
+				 */
+				const float operator[] (const key_t& key) const
+				{
+						const entry* item = lookup(key);
+						return (item == nullptr) ? 0.0 : item->value;
+				}
+
+				/*
+				   @param key - feature representation
+				   @return true if the feature is present in Top-K set
+				 */
+				const bool find (const key_t& key) const
+				{
+						return lookup(key) != nullptr;
+				}
+
+				bool full() const
+				{
+						return (keys.size() >= (size_t) N);
+				}
+
+				/*
+				   @return a lower bound on the smallest magnitude in the set if the Top-K set is full
+				 */
+				float minimum() const
+				{
+						return threshold;
+				}
+
+				/*
+				   Update a feature in the set, or buffer a new feature greater than the minimum value
+				   @param key - feature representation
+				   @param value - corresponding value for the feature
+				 */
+				void push(const key_t& key, const float value)
+				{
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						entry* item = filter.contains(hash) ? dict.find(key, hash) : nullptr;
+						if(item != nullptr)
+						{
+								item->value = value;
+								mark(item->slot);
+								// Keep the threshold a lower bound until the next flush recomputes it
+								if(full())
+								{
+										threshold = std::min(threshold, my_abs(value));
+								}
+						}
+						else if(!full())
+						{
+								// Nothing is evicted while the set is filling
+								if(filter.saturated())
+								{
+										rebuild();
+								}
+								filter.insert(hash);
+								entry& result = dict.insert(key, hash);
+								result.value = value;
+								result.slot = keys.size();
+								mark(keys.size());
+								keys.push_back(key);
+								hashes.push_back(hash);
+								if(full())
+								{
+										update_threshold();
+								}
+						}
+						else if(my_abs(value) > threshold * EPS)
+						{
+								buffer.push_back({key, hash, value});
+								if(buffer.size() >= (size_t) B)
+								{
+										flush();
+								}
+						}
+				}
+
+				/*
+				   Count one training example - every M examples the buffer is merged even if it is not full
+				 */
+				void step()
+				{
+						if(M > 0 && ++examples >= (size_t) M)
+						{
+								examples = 0;
+								flush();
+						}
+				}
+
+				/*
+				   Merge the buffered features into the set - the latest value of a feature wins,
+				   then only the N features with the largest magnitudes are kept
+				 */
+				void flush()
+				{
+						if(buffer.empty())
+						{
+								return;
+						}
+
+						const size_t current = keys.size();
+						std::vector<float> values(current);
+						for(size_t idx = 0; idx < current; ++idx)
+						{
+								values[idx] = dict.find(keys[idx], hashes[idx])->value;
+						}
+
+						// New features are numbered after the set
+						std::vector<candidate> admitted;
+						for(const candidate& item : buffer)
+						{
+								entry* result = dict.find(item.key, item.hash);
+								if(result == nullptr)
+								{
+										result = &dict.insert(item.key, item.hash);
+										result->slot = current + admitted.size();
+										admitted.push_back(item);
+										values.push_back(item.value);
+								}
+								else if((size_t) result->slot < current)
+								{
+										mark(result->slot);
+								}
+								values[result->slot] = item.value;
+						}
+						buffer.clear();
+						logged = 0;
+
+						// Partial selection - the N largest magnitudes are kept
+						std::vector<bool> keep(values.size(), true);
+						if(values.size() > (size_t) N)
+						{
+								std::vector<std::pair<float, int>> order(values.size());
+								for(size_t idx = 0; idx < values.size(); ++idx)
+								{
+										order[idx] = std::make_pair(my_abs(values[idx]), idx);
+								}
+								std::nth_element(order.begin(), order.begin() + (N-1), order.end(), std::greater<std::pair<float, int>>());
+								keep.assign(values.size(), false);
+								for(size_t idx = 0; idx < (size_t) N; ++idx)
+								{
+										keep[order[idx].second] = true;
+								}
+						}
+
+						// Kept features take the slots of evicted features, the rest are appended while the set is filling
+						size_t slot = 0;
+						for(size_t idx = 0; idx < admitted.size(); ++idx)
+						{
+								if(!keep[current + idx])
+								{
+										continue;
+								}
+								while(slot < current && keep[slot])
+								{
+										++slot;
+								}
+
+								const size_t target = (slot < current) ? slot++ : keys.size();
+								if(target == keys.size())
+								{
+										keys.push_back(admitted[idx].key);
+										hashes.push_back(admitted[idx].hash);
+								}
+								else
+								{
+										keys[target] = admitted[idx].key;
+										hashes[target] = admitted[idx].hash;
+								}
+								values[target] = values[current + idx];
+								mark(target);
+						}
+						values.resize(keys.size());
+
+						index(values);
+						if(full())
+						{
+								update_threshold();
+						}
+				}
+
+				/*
+				   Visit every feature in the Top-K set - call flush() first to include the buffer
+				   @param func - called with the key and the signed value of each feature
+				 */
+				template<typename F>
+				void for_each(F func) const
+				{
+						for(size_t idx = 0; idx < keys.size(); ++idx)
+						{
+								func(keys[idx], dict.find(keys[idx], hashes[idx])->value);
+						}
+				}
+
+				/*
+				   Visit every buffered feature that was not merged into the set yet
+				   @param func - called with the key and the signed value of each feature
+				 */
+				template<typename F>
+				void for_each_pending(F func) const
+				{
+						for(const candidate& item : buffer)
+						{
+								func(item.key, item.value);
+						}
+				}
+
+				/*
+				   Buffer a feature without the threshold check - restores the buffer of a checkpoint
+				   @param key - feature representation
+				   @param value - corresponding value for the feature
+				 */
+				void add_pending(const key_t& key, const float value)
+				{
+						buffer.push_back({key, flat_table<key_t>::hash(key), value});
+				}
+
+				/*
+				   Record the slots changed from now on, for incremental checkpoints - the current set and buffer count as changed
+				 */
+				void track()
+				{
+						changed.assign((N + 63) / 64, 0);
+						for(size_t idx = 0; idx < keys.size(); ++idx)
+						{
+								mark(idx);
+						}
+						logged = 0;
+				}
+
+				/*
+				   Copy the slots changed and the features buffered since the last call - the checkpoint pause, after track()
+				   @param log - replaced by the changes, applied to a heap_mirror by the checkpointer thread
+				 */
+				void collect(heap_log<key_t>& log)
+				{
+						log.size = keys.size();
+						size_t total = 0;
+						for(const uint64_t bits : changed)
+						{
+								total += __builtin_popcountll(bits);
+						}
+						log.changes.clear();
+						log.changes.reserve(total);
+						for(size_t word = 0; word < changed.size(); ++word)
+						{
+								uint64_t bits = changed[word];
+								changed[word] = 0;
+								while(bits)
+								{
+										const uint32_t slot = word * 64 + __builtin_ctzll(bits);
+										bits &= bits - 1;
+										log.changes.push_back({slot, keys[slot], dict.find(keys[slot], hashes[slot])->value});
+								}
+						}
+
+						log.pending_from = logged;
+						log.pending.clear();
+						log.pending.reserve(buffer.size() - logged);
+						for(size_t idx = logged; idx < buffer.size(); ++idx)
+						{
+								log.pending.push_back({buffer[idx].key, buffer[idx].value});
+						}
+						logged = buffer.size();
+				}
+
+				/*
+				   Load the Top-K set and its buffer from a binary checkpoint stream
+				   @param myfile - binary stream, e.g. a Top-K Heap File opened in binary mode
+				   @return true if the set was read
+				 */
+				bool load(std::istream& myfile)
+				{
+						return load_heap<key_t>(myfile, *this);
+				}
+
+				/*
+				   Save the Top-K set and its buffer to a binary checkpoint stream, without a flush
+				   @param myfile - binary stream, e.g. a Top-K Heap File opened in binary mode
+				 */
+				void save(std::ostream& myfile) const
+				{
+						save_heap<key_t>(myfile, *this);
+				}
+
+				/*
+				   @return current size of the Top-K set
+				 */
+				size_t size() const
+				{
+						return keys.size();
+				}
+};
+
+#endif // CMS_ML_BATCH_TOPK_H_
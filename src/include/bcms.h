@@ -0,0 +1,149 @@
+#ifndef CMS_ML_BCMS_H_
+#define CMS_ML_BCMS_H_
+
+#include "cms.h"
+
+// Number of bits needed to index value buckets
+constexpr size_t block_bits(const size_t value)
+{
+		return (value <= 1) ? 0 : 1 + block_bits(value >> 1);
+}
+
+/*
+   Blocked Count-Sketch - All N counters for a feature live in one block of N*W buckets
+   One hash selects the block, the remaining bits select the bucket and sign for each row inside the block
+   Each bucket holds the K class weights padded to 8 floats (800 bytes for K = 193), so a block spans N*W buckets
+   (about 38 KB for N = 3, W = 16) - a feature's rows share one huge page and its TLB entry, not a cache line
+   Two features in the same block collide in each row with probability 1/W, which is higher than in CMS
+   Not used by default - switch a main's sketch_t typedef to compare it with CMS
+   Uses the same hc<N> cache and cms_retrieve / cms_update API as CMS
+
+   @param W - buckets per row inside a block (power of two)
+   @param hash_t - hash family policy (see hash_family.h)
+   @param counter_t - counter storage format (see counter.h)
+ */
+template<size_t N, size_t W = 16, typename hash_t = murmur3_hash, typename counter_t = fp32_counter>
+class BCMS : public CMS<N, hash_t, counter_t>
+{
+		static_assert((W & (W-1)) == 0, "W must be a power of two");
+
+		private:
+				typedef CMS<N, hash_t, counter_t> base_t;
+
+				// Bits consumed by each row - offset inside the block and sign
+				static const size_t SHIFT = block_bits(W) + 1;
+				static_assert(N * SHIFT <= 32, "Not enough hash bits for N rows");
+
+				const size_t BLOCKS;
+
+				static size_t align(const size_t D)
+				{
+						return ((D + W - 1) / W) * W;
+				}
+
+				/*
+				   Block from the low 32 bits, offsets and signs from the high 32 bits
+				 */
+				void split(const uint64_t hash, hc<N>& result) const
+				{
+						const size_t block = hash_t::index(hash, BLOCKS) * N * W;
+						uint32_t rest = hash >> 32;
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								result.hash[idx] = block + idx * W + (rest & (W-1));
+								result.sign[idx] = ((rest >> (SHIFT-1)) & 0x1) ? 1.0 : -1.0;
+								rest >>= SHIFT;
+						}
+				}
+
+		public:
+				using base_t::update;
+				using base_t::retrieve;
+				using base_t::hash;
+
+				/*
+				   @param _K - Number of classes represented by Count-Sketch
+				   @param _D - Number of weights allocated for each class per row - rounded up to a multiple of W
+				   @param config - page and NUMA policies for the sketch memory
+				 */
+				BCMS(size_t _K, size_t _D, const mem_config& config = mem_config()) :
+						base_t(_K, align(_D), config),
+						BLOCKS(align(_D) / W)
+				{}
+
+				/*
+				   Update feature in the Count-Sketch
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @param value - Update value for the feature
+				   @return the new value for the feature
+				 */
+				float update(const void* key, const int len, float value)
+				{
+						hc<N> cache;
+						hash(key, len, cache);
+						return update(cache, value);
+				}
+
+				/*
+				   Get feature in the Count-Sketch
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @return the value for the feature
+				 */
+				float retrieve(const void* key, const int len) const
+				{
+						hc<N> cache;
+						split(this->hashes[0](key, len), cache);
+						return retrieve(cache);
+				}
+
+				/*
+				   @return a fingerprint of the hash functions and block layout
+				 */
+				uint32_t signature() const
+				{
+						const uint32_t result = base_t::signature();
+						return MurmurHash3_x86_32 (&result, sizeof(result), W);
+				}
+
+				/*
+				   Precompute the Hash Index and Sign - one hash evaluation for all N rows
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @param result - struct to store the cached values
+				 */
+				void hash(const void* key, const int len, hc<N>& result)
+				{
+						split(this->hashes[0](key, len), result);
+				}
+
+				/*
+				   Precompute the Hash Index and Sign for many features - LANES keys per batched hash
+				   @param keys - pointers to feature representations
+				   @param len - length of every feature representation
+				   @param result - array of count structs to store the cached values
+				   @param count - number of features
+				 */
+				void hash(const void* const* keys, const int len, hc<N>* result, const size_t count)
+				{
+						uint64_t values[LANES];
+
+						size_t pos = 0;
+						for(; pos + LANES <= count; pos += LANES)
+						{
+								this->hashes[0](keys + pos, len, values);
+								for(size_t ldx = 0; ldx < LANES; ++ldx)
+								{
+										split(values[ldx], result[pos+ldx]);
+								}
+						}
+
+						for(; pos < count; ++pos)
+						{
+								hash(keys[pos], len, result[pos]);
+						}
+				}
+};
+
+#endif // CMS_ML_BCMS_H_
@@ -0,0 +1,101 @@
+#ifndef CMS_ML_BLOOM_FILTER_H_
+#define CMS_ML_BLOOM_FILTER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+#include <immintrin.h>
+
+/*
+   Split Block Bloom Filter - Approximate membership for the Top-K heaps
+   Each key sets one bit in each of the 8 words of a single 256-bit block,
+   so a query is one block read and one AVX2 test, and most absent keys are rejected without touching the hash table
+   There are no false negatives - a positive answer is confirmed by the exact table
+   Keys cannot be removed, so the owner rebuilds the filter once more keys were inserted than it was sized for
+ */
+class bloom_filter
+{
+		private:
+				// Bits of filter per expected key - about 0.1% false positives when full
+				static const size_t BITS_PER_KEY = 16;
+				static const size_t BLOCK_BITS = 256;
+				static const size_t WORDS = BLOCK_BITS / 32;
+
+				std::vector<uint32_t> memory;
+				size_t count;
+				size_t capacity;
+				size_t inserted;
+
+				__m256i block_mask(const uint64_t hash) const
+				{
+						// Odd multipliers select one bit in each 32-bit word from the low half of the hash
+						const __m256i salt = _mm256_setr_epi32(0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+										0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31);
+						__m256i bits = _mm256_mullo_epi32(_mm256_set1_epi32((uint32_t) hash), salt);
+						bits = _mm256_srli_epi32(bits, 27);
+						return _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+				}
+
+				// The high half of the hash picks the block - blocks are aligned to cache lines, so a query never reads two lines
+				uint32_t* block(const uint64_t hash) const
+				{
+						const uintptr_t address = ((uintptr_t) memory.data() + 63) & ~(uintptr_t) 63;
+						return (uint32_t*) address + WORDS * (((hash >> 32) * count) >> 32);
+				}
+
+		public:
+				/*
+				   @param keys - number of keys the filter is sized for
+				 */
+				bloom_filter(const size_t keys = 0)
+				{
+						reset(keys);
+				}
+
+				/*
+				   Erase all keys and resize the filter
+				   @param keys - number of keys the filter is sized for
+				 */
+				void reset(const size_t keys)
+				{
+						capacity = std::max(keys, (size_t) 64);
+						count = (capacity * BITS_PER_KEY + BLOCK_BITS - 1) / BLOCK_BITS;
+						inserted = 0;
+
+						// Extra words for the cache line alignment
+						memory.assign(count * WORDS + 16, 0);
+				}
+
+				/*
+				   @param hash - 64-bit hash of the key
+				 */
+				void insert(const uint64_t hash)
+				{
+						uint32_t* ptr = block(hash);
+						const __m256i value = _mm256_or_si256(_mm256_load_si256((const __m256i*) ptr), block_mask(hash));
+						_mm256_store_si256((__m256i*) ptr, value);
+						++inserted;
+				}
+
+				/*
+				   @param hash - 64-bit hash of the key
+				   @return false if the key was never inserted, true if it may have been
+				 */
+				bool contains(const uint64_t hash) const
+				{
+						const __m256i value = _mm256_load_si256((const __m256i*) block(hash));
+						return _mm256_testc_si256(value, block_mask(hash));
+				}
+
+				/*
+				   @return true once the filter holds as many keys as it is sized for - further keys raise the false positive rate
+				 */
+				bool saturated() const
+				{
+						return inserted >= capacity;
+				}
+};
+
+#endif // CMS_ML_BLOOM_FILTER_H_
@@ -0,0 +1,514 @@
+#ifndef CMS_ML_CHECKPOINT_H_
+#define CMS_ML_CHECKPOINT_H_
+
+#include "table_memory.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <streambuf>
+#include <algorithm>
+
+/*
+   Checkpoint - Binary weight file for CMS, BCMS, SCMS and MEM
+   File Layout:
+     checkpoint_header
+     seeds[header.seeds]
+     zero padding up to header.offset
+     raw table values[header.size], padded to a multiple of CHECKPOINT_ALIGN
+   The table starts on a CHECKPOINT_ALIGN boundary, so it is mapped straight into the weight memory without a copy
+   Top-K heaps are written as a heap_header followed by the raw keys[count + pending] and values[count + pending]
+
+   Delta - Blocks of a weight table changed since a base checkpoint, plus opaque trainer state
+   The header records the inode, size and mtime of its base, which a rename keeps, so a delta is never applied to another base
+   File Layout:
+     delta_header
+     index[blocks] - changed block numbers in increasing order
+     data - block_size bytes for each changed block, the last block of the table may be shorter
+     state[state_bytes]
+ */
+const uint64_t CHECKPOINT_MAGIC = 0x5450434b534d4d43;
+const uint32_t CHECKPOINT_VERSION = 2;
+const uint64_t HEAP_MAGIC = 0x5048454150534d43;
+const uint64_t DELTA_MAGIC = 0x41544c4544534d43;
+
+// Alignment of the table inside the file - a multiple of the page size on every supported platform
+const size_t CHECKPOINT_ALIGN = 1 << 16;
+
+// Bytes per write call
+const size_t CHECKPOINT_CHUNK = 1 << 26;
+
+// Weight table stored in a checkpoint
+enum class checkpoint_kind : uint32_t
+{
+		cms = 1,
+		scms = 2,
+		mem = 3
+};
+
+struct checkpoint_header
+{
+		uint64_t magic;
+		uint32_t version;
+		checkpoint_kind kind;
+		uint32_t hash_id;
+		uint32_t counter_id;
+		uint32_t value_size;
+		uint32_t seeds;
+		uint64_t K;
+		uint64_t D;
+		uint64_t N;
+		uint64_t size;
+		uint64_t offset;
+};
+
+// count - features in the set
+// pending - buffered features that were not merged into the set yet
+struct heap_header
+{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t key_size;
+		uint64_t count;
+		uint64_t pending;
+};
+
+// Identity of a base checkpoint
+struct file_stamp
+{
+		uint64_t inode;
+		uint64_t size;
+		int64_t mtime;
+
+		bool operator==(const file_stamp& other) const
+		{
+				return inode == other.inode && size == other.size && mtime == other.mtime;
+		}
+};
+
+struct delta_header
+{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t block_size;
+		uint64_t blocks;
+		uint64_t table_bytes;
+		uint64_t state_bytes;
+		file_stamp base;
+};
+
+/*
+   @param filename - base checkpoint
+   @param stamp - set to the identity of the file
+   @return true if the file exists
+ */
+inline bool stamp_file(const char* filename, file_stamp& stamp)
+{
+		struct stat sb;
+		if(stat(filename, &sb) != 0)
+		{
+				return false;
+		}
+		stamp.inode = sb.st_ino;
+		stamp.size = sb.st_size;
+		stamp.mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+		return true;
+}
+
+/*
+   String Sink - Stream buffer that appends to a std::string, so the parts of the trainer state are written into one buffer
+ */
+class string_sink : public std::streambuf
+{
+		private:
+				std::string& buffer;
+
+		protected:
+				std::streamsize xsputn(const char* ptr, const std::streamsize count) override
+				{
+						buffer.append(ptr, count);
+						return count;
+				}
+
+				int_type overflow(const int_type value) override
+				{
+						if(!traits_type::eq_int_type(value, traits_type::eof()))
+						{
+								buffer.push_back(traits_type::to_char_type(value));
+						}
+						return traits_type::not_eof(value);
+				}
+
+		public:
+				explicit string_sink(std::string& _buffer) : buffer(_buffer) {}
+};
+
+/*
+   @return a header describing a weight table - magic, version and offset are filled in by write_checkpoint
+ */
+inline checkpoint_header make_header(const checkpoint_kind kind, const uint32_t hash_id, const uint32_t counter_id, const uint32_t value_size,
+				const uint32_t seeds, const size_t K, const size_t D, const size_t N, const size_t size)
+{
+		checkpoint_header header = {};
+		header.kind = kind;
+		header.hash_id = hash_id;
+		header.counter_id = counter_id;
+		header.value_size = value_size;
+		header.seeds = seeds;
+		header.K = K;
+		header.D = D;
+		header.N = N;
+		header.size = size;
+		return header;
+}
+
+/*
+   @param fd - open file
+   @param ptr - bytes to write
+   @param bytes - number of bytes
+   @return true if every byte was written
+ */
+inline bool write_all(const int fd, const void* ptr, size_t bytes)
+{
+		const char* pos = reinterpret_cast<const char*>(ptr);
+		while(bytes > 0)
+		{
+				const ssize_t result = write(fd, pos, std::min(bytes, CHECKPOINT_CHUNK));
+				if(result <= 0)
+				{
+						return false;
+				}
+				pos += result;
+				bytes -= result;
+		}
+		return true;
+}
+
+/*
+   Write a checkpoint - the file is written next to the target and renamed, so an existing checkpoint is replaced atomically
+   @param filename - Checkpoint File
+   @param header - geometry of the table, magic, version and offset are filled in
+   @param seeds - hash seeds, header.seeds of them
+   @param data - raw table, header.size values of header.value_size bytes
+   @return true if the checkpoint was written
+ */
+inline bool write_checkpoint(const char* filename, checkpoint_header header, const uint32_t* seeds, const void* data)
+{
+		const size_t prefix = sizeof(checkpoint_header) + sizeof(uint32_t) * header.seeds;
+		const size_t bytes = header.size * header.value_size;
+		header.magic = CHECKPOINT_MAGIC;
+		header.version = CHECKPOINT_VERSION;
+		header.offset = ((prefix + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN) * CHECKPOINT_ALIGN;
+
+		const std::string temp = std::string(filename) + ".tmp";
+		const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+		{
+				return false;
+		}
+
+		const std::vector<char> padding(CHECKPOINT_ALIGN, 0);
+		const size_t tail = (CHECKPOINT_ALIGN - bytes % CHECKPOINT_ALIGN) % CHECKPOINT_ALIGN;
+		bool status = write_all(fd, &header, sizeof(header))
+				&& write_all(fd, seeds, sizeof(uint32_t) * header.seeds)
+				&& write_all(fd, padding.data(), header.offset - prefix)
+				&& write_all(fd, data, bytes)
+				&& write_all(fd, padding.data(), tail)
+				&& fdatasync(fd) == 0;
+		status = (close(fd) == 0) && status;
+
+		if(!status || rename(temp.c_str(), filename) != 0)
+		{
+				unlink(temp.c_str());
+				return false;
+		}
+		return true;
+}
+
+/*
+   Write the changed blocks of a weight table - the blocks are staged in large buffers, so scattered blocks still become large writes
+   The table may be updated while it is copied, a block then holds the values of some point during the copy
+   @param filename - Delta File, replaced atomically
+   @param table - raw weight table
+   @param table_bytes - size of the table
+   @param block_size - bytes per block
+   @param bitmap - one bit per block, set for the changed blocks
+   @param state - trainer state stored after the blocks
+   @param stamp - identity of the base checkpoint the blocks apply to
+   @return true if the delta was written
+ */
+inline bool write_delta(const char* filename, const void* table, const size_t table_bytes, const size_t block_size,
+				const std::vector<uint64_t>& bitmap, const std::string& state, const file_stamp& stamp)
+{
+		std::vector<uint32_t> index;
+		for(size_t word = 0; word < bitmap.size(); ++word)
+		{
+				for(uint64_t bits = bitmap[word]; bits; bits &= bits - 1)
+				{
+						index.push_back(word * 64 + __builtin_ctzll(bits));
+				}
+		}
+
+		const delta_header header = {DELTA_MAGIC, CHECKPOINT_VERSION, (uint32_t) block_size, index.size(), table_bytes, state.size(), stamp};
+		const std::string temp = std::string(filename) + ".tmp";
+		const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+		{
+				return false;
+		}
+
+		bool status = write_all(fd, &header, sizeof(header)) && write_all(fd, index.data(), sizeof(uint32_t) * index.size());
+
+		const char* base = reinterpret_cast<const char*>(table);
+		std::vector<char> buffer;
+		buffer.reserve(std::min(CHECKPOINT_CHUNK, index.size() * block_size));
+		for(size_t idx = 0; idx < index.size() && status; ++idx)
+		{
+				const size_t offset = (size_t) index[idx] * block_size;
+				const size_t bytes = std::min(block_size, table_bytes - offset);
+				if(buffer.size() + bytes > CHECKPOINT_CHUNK)
+				{
+						status = write_all(fd, buffer.data(), buffer.size());
+						buffer.clear();
+				}
+				buffer.insert(buffer.end(), base + offset, base + offset + bytes);
+		}
+		status = status && write_all(fd, buffer.data(), buffer.size())
+				&& write_all(fd, state.data(), state.size())
+				&& fdatasync(fd) == 0;
+		status = (close(fd) == 0) && status;
+
+		if(!status || rename(temp.c_str(), filename) != 0)
+		{
+				unlink(temp.c_str());
+				return false;
+		}
+		return true;
+}
+
+/*
+   @param filename - Delta File
+   @param base - set to the identity of the base checkpoint of the delta
+   @return true if the file is a delta
+ */
+inline bool delta_base(const char* filename, file_stamp& base)
+{
+		const int fd = open(filename, O_RDONLY);
+		if(fd < 0)
+		{
+				return false;
+		}
+
+		delta_header header;
+		const bool status = pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)
+				&& header.magic == DELTA_MAGIC && header.version == CHECKPOINT_VERSION;
+		close(fd);
+		base = header.base;
+		return status;
+}
+
+/*
+   Copy the blocks of a delta into a weight table that was loaded from its base checkpoint
+   @param filename - Delta File
+   @param table - raw weight table
+   @param table_bytes - size of the table, must match the delta
+   @param state - set to the trainer state stored in the delta
+   @return true if the delta was applied
+ */
+inline bool apply_delta(const char* filename, void* table, const size_t table_bytes, std::string& state)
+{
+		const int fd = open(filename, O_RDONLY);
+		if(fd < 0)
+		{
+				return false;
+		}
+
+		delta_header header;
+		bool status = pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)
+				&& header.magic == DELTA_MAGIC && header.version == CHECKPOINT_VERSION && header.table_bytes == table_bytes;
+
+		std::vector<uint32_t> index;
+		size_t pos = sizeof(header);
+		if(status)
+		{
+				index.resize(header.blocks);
+				const ssize_t bytes = sizeof(uint32_t) * index.size();
+				status = (pread(fd, index.data(), bytes, pos) == bytes);
+				pos += bytes;
+		}
+
+		char* base = reinterpret_cast<char*>(table);
+		for(size_t idx = 0; idx < index.size() && status; ++idx)
+		{
+				const size_t offset = (size_t) index[idx] * header.block_size;
+				const ssize_t bytes = std::min((size_t) header.block_size, table_bytes - offset);
+				status = (offset < table_bytes) && (pread(fd, base + offset, bytes, pos) == bytes);
+				pos += bytes;
+		}
+
+		if(status)
+		{
+				state.resize(header.state_bytes);
+				status = (pread(fd, &state[0], state.size(), pos) == (ssize_t) state.size());
+		}
+		close(fd);
+		return status;
+}
+
+/*
+   Checkpoint Reader - Validates the header and seeds, then maps the table into the weight memory
+ */
+class checkpoint_reader
+{
+		private:
+				int fd;
+				bool status;
+				checkpoint_header header;
+				std::vector<uint32_t> seeds;
+
+		public:
+				/*
+				   @param filename - Checkpoint File
+				   @param kind - expected weight table
+				 */
+				checkpoint_reader(const char* filename, const checkpoint_kind kind) : fd(-1), status(false)
+				{
+						fd = open(filename, O_RDONLY);
+						if(fd < 0)
+						{
+								return;
+						}
+
+						struct stat sb;
+						if(fstat(fd, &sb) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+						{
+								return;
+						}
+
+						if(header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION || header.kind != kind
+										|| header.offset % CHECKPOINT_ALIGN != 0
+										|| (size_t) sb.st_size < header.offset + header.size * header.value_size)
+						{
+								std::cerr << "Invalid Checkpoint:\t" << filename << std::endl;
+								return;
+						}
+
+						seeds.resize(header.seeds);
+						const ssize_t bytes = sizeof(uint32_t) * header.seeds;
+						status = (pread(fd, seeds.data(), bytes, sizeof(header)) == bytes);
+				}
+
+				~checkpoint_reader()
+				{
+						if(fd >= 0)
+						{
+								close(fd);
+						}
+				}
+
+				checkpoint_reader(const checkpoint_reader&) = delete;
+				checkpoint_reader& operator=(const checkpoint_reader&) = delete;
+
+				/*
+				   @return true if the table matches the expected geometry and formats
+				 */
+				bool matches(const size_t K, const size_t D, const size_t N, const size_t size,
+								const uint32_t value_size, const uint32_t hash_id, const uint32_t counter_id) const
+				{
+						return status && header.K == K && header.D == D && header.N == N && header.size == size
+								&& header.value_size == value_size && header.hash_id == hash_id && header.counter_id == counter_id;
+				}
+
+				/*
+				   Map the table copy-on-write over the weight memory - pages are read from the file on first access
+				   @param memory - weight memory of at least header.size values
+				   @return true if the table was mapped
+				 */
+				bool map(table_memory& memory) const
+				{
+						return status && memory.map_file(fd, header.offset, header.size * header.value_size);
+				}
+
+				const std::vector<uint32_t>& file_seeds() const
+				{
+						return seeds;
+				}
+
+				operator bool() const
+				{
+						return status;
+				}
+};
+
+/*
+   Write a Top-K heap as it is - the set, then the features still waiting to be merged into it
+   Keys must be trivially copyable (std::array, fingerprint_t, interned ids)
+   @param myfile - binary output stream
+   @param heap - TopK or BatchTopK
+ */
+template<typename key_t, typename heap_t>
+void save_heap(std::ostream& myfile, const heap_t& heap)
+{
+		std::vector<key_t> keys;
+		std::vector<float> values;
+		keys.reserve(heap.size());
+		values.reserve(heap.size());
+		auto add = [&](const key_t& key, const float value)
+		{
+				keys.push_back(key);
+				values.push_back(value);
+		};
+		heap.for_each(add);
+		const size_t count = keys.size();
+		heap.for_each_pending(add);
+
+		const heap_header header = {HEAP_MAGIC, CHECKPOINT_VERSION, sizeof(key_t), count, keys.size() - count};
+		myfile.write((const char*) &header, sizeof(header));
+		myfile.write((const char*) keys.data(), sizeof(key_t) * keys.size());
+		myfile.write((const char*) values.data(), sizeof(float) * values.size());
+}
+
+/*
+   Read a Top-K heap written by save_heap - the set is pushed into the heap and the pending features are buffered again, without a flush
+   @param myfile - binary input stream
+   @param heap - empty TopK or BatchTopK
+   @return true if a complete heap with the same key type was read
+ */
+template<typename key_t, typename heap_t>
+bool load_heap(std::istream& myfile, heap_t& heap)
+{
+		heap_header header;
+		if(!myfile.read((char*) &header, sizeof(header)) || header.magic != HEAP_MAGIC
+						|| header.version != CHECKPOINT_VERSION || header.key_size != sizeof(key_t))
+		{
+				return false;
+		}
+
+		std::vector<key_t> keys(header.count + header.pending);
+		std::vector<float> values(header.count + header.pending);
+		myfile.read((char*) keys.data(), sizeof(key_t) * keys.size());
+		myfile.read((char*) values.data(), sizeof(float) * values.size());
+		if(!myfile)
+		{
+				return false;
+		}
+
+		for(size_t idx = 0; idx < header.count; ++idx)
+		{
+				heap.push(keys[idx], values[idx]);
+		}
+		for(size_t idx = header.count; idx < keys.size(); ++idx)
+		{
+				heap.add_pending(keys[idx], values[idx]);
+		}
+		return true;
+}
+
+#endif /* CMS_ML_CHECKPOINT_H_ */
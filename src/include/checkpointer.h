@@ -0,0 +1,242 @@
+#ifndef CMS_ML_CHECKPOINTER_H_
+#define CMS_ML_CHECKPOINTER_H_
+
+#include "checkpoint.h"
+#include "dirty_map.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+/*
+   Background Checkpointer - Periodically snapshots a sketch (CMS, BCMS or MEM) while the Hogwild workers keep training
+     <prefix>.base - full checkpoint written by sketch_t::save
+     <prefix>.delta - blocks changed since the base plus the trainer state, replaced by every checkpoint
+   The sketch marks the blocks written by each update in a dirty map, and the background thread copies only those blocks
+   The workers are never stopped for the sketch - as with Hogwild itself, a block copied during an update may hold part of it,
+   and the block is dirty again and copied by the next checkpoint
+   The trainer state (Top-K heaps) is not thread-safe, so the training loop copies it in poll() between batches - the only pause -
+   and the background thread serializes the copy into one buffer that becomes the state of the delta
+   The heaps only copy their changes since the last checkpoint (heap_log.h), so the pause does not grow with the size of the heaps
+   A new base replaces the delta once more than a rebase fraction of the blocks changed since the last base
+   It is written to <prefix>.base.next, its delta is written next, and only then is it renamed to <prefix>.base - each delta
+   records the identity of its base, so a crash at any point leaves a base and delta that belong together
+   @param sketch_t - weight table with track(), table(), table_bytes(), save() and initialize()
+ */
+template<typename sketch_t>
+class checkpointer
+{
+		private:
+				sketch_t& sketch;
+				const std::string base_file;
+				const std::string next_file;
+				const std::string delta_file;
+				const std::chrono::milliseconds interval;
+				const double rebase;
+
+				dirty_map dirty;
+
+				// Blocks changed since the base and identity of the base - only used by the background thread
+				std::vector<uint64_t> changed;
+				bool has_base;
+				file_stamp base;
+
+				// requested - the background thread waits for the trainer state
+				// ready - poll() copied the trainer state
+				// serialize - writes the copy, called by the background thread
+				std::mutex mtx;
+				std::condition_variable cv;
+				std::atomic<bool> requested;
+				bool ready;
+				bool stopping;
+				std::function<void(std::ostream&)> serialize;
+				std::string state;
+				std::thread worker;
+
+				/*
+				   Write a delta against the current base, or a new base when too much has changed
+				   @param snapshot - serialized trainer state
+				 */
+				bool checkpoint(const std::string& snapshot)
+				{
+						dirty.collect(changed);
+
+						size_t count = 0;
+						for(const uint64_t word : changed)
+						{
+								count += __builtin_popcountll(word);
+						}
+
+						if(!has_base || count > rebase * dirty.size())
+						{
+								// The previous base and delta stay valid until the new delta is in place
+								if(!sketch.save(next_file.c_str()) || !stamp_file(next_file.c_str(), base))
+								{
+										return false;
+								}
+								std::fill(changed.begin(), changed.end(), 0);
+								has_base = true;
+								return write_delta(delta_file.c_str(), sketch.table(), sketch.table_bytes(), dirty.block_size(), changed, snapshot, base)
+										&& rename(next_file.c_str(), base_file.c_str()) == 0;
+						}
+						return write_delta(delta_file.c_str(), sketch.table(), sketch.table_bytes(), dirty.block_size(), changed, snapshot, base);
+				}
+
+				void run()
+				{
+						std::unique_lock<std::mutex> lock(mtx);
+						while(!stopping)
+						{
+								if(cv.wait_for(lock, interval, [this] { return stopping; }))
+								{
+										break;
+								}
+
+								// Ask the training loop for its state and wait for the next poll()
+								requested.store(true, std::memory_order_release);
+								cv.wait(lock, [this] { return ready || stopping; });
+								if(!ready)
+								{
+										break;
+								}
+								ready = false;
+								lock.unlock();
+
+								// poll() is not called again before the next request, so the copy is stable while it is written
+								const auto start = std::chrono::steady_clock::now();
+								state.clear();
+								string_sink sink(state);
+								std::ostream out(&sink);
+								serialize(out);
+								const bool status = checkpoint(state);
+								const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+								std::cerr << (status ? "Checkpoint:\t" : "Checkpoint Failure:\t") << elapsed.count() << "s" << std::endl;
+
+								lock.lock();
+						}
+				}
+
+		public:
+				/*
+				   Start tracking the sketch and checkpointing it in the background
+				   @param _sketch - weight table to snapshot
+				   @param prefix - path prefix of the base and delta files
+				   @param _interval - time between checkpoints
+				   @param _rebase - fraction of changed blocks that triggers a new base
+				   @param block_bits - log2 of the block size in bytes
+				 */
+				checkpointer(sketch_t& _sketch, const std::string& prefix, const std::chrono::milliseconds _interval,
+								const double _rebase = 0.5, const size_t block_bits = 12) :
+						sketch(_sketch),
+						base_file(prefix + ".base"),
+						next_file(prefix + ".base.next"),
+						delta_file(prefix + ".delta"),
+						interval(_interval),
+						rebase(_rebase),
+						dirty(_sketch.table_bytes(), block_bits),
+						has_base(false),
+						base(),
+						requested(false),
+						ready(false),
+						stopping(false)
+				{
+						sketch.track(&dirty);
+						worker = std::thread([this] { run(); });
+				}
+
+				~checkpointer()
+				{
+						stop();
+				}
+
+				checkpointer(const checkpointer&) = delete;
+				checkpointer& operator=(const checkpointer&) = delete;
+
+				/*
+				   Called by the training loop between batches - copies the trainer state when a checkpoint is due
+				   @param copy_state - copies the trainer state, called in the pause
+				   @param save_state - writes the copy to a binary std::ostream, called later by the background thread
+				 */
+				template<typename F, typename G>
+				void poll(F copy_state, G save_state)
+				{
+						if(!requested.load(std::memory_order_acquire))
+						{
+								return;
+						}
+
+						copy_state();
+
+						std::lock_guard<std::mutex> lock(mtx);
+						serialize = save_state;
+						ready = true;
+						requested.store(false, std::memory_order_relaxed);
+						cv.notify_all();
+				}
+
+				/*
+				   Stop checkpointing - a checkpoint in progress is finished first
+				 */
+				void stop()
+				{
+						{
+								std::lock_guard<std::mutex> lock(mtx);
+								stopping = true;
+						}
+						cv.notify_all();
+						if(worker.joinable())
+						{
+								worker.join();
+						}
+						sketch.track(nullptr);
+				}
+
+				/*
+				   Load the last checkpoint - the base is mapped and the delta blocks are copied over it
+				   A delta written for <prefix>.base.next means a rebase stopped before its rename, which is finished first
+				   @param sketch - weight table with the same geometry
+				   @param prefix - path prefix of the base and delta files
+				   @param load_state - reads the trainer state from a binary std::istream, only called if the delta matches the base
+				   @return true if the base was loaded
+				 */
+				template<typename F>
+				static bool restore(sketch_t& sketch, const std::string& prefix, F load_state)
+				{
+						const std::string base_file = prefix + ".base";
+						const std::string next_file = prefix + ".base.next";
+						const std::string delta_file = prefix + ".delta";
+
+						file_stamp base, current;
+						bool matched = delta_base(delta_file.c_str(), base);
+						if(matched && !(stamp_file(base_file.c_str(), current) && current == base))
+						{
+								matched = stamp_file(next_file.c_str(), current) && current == base
+										&& rename(next_file.c_str(), base_file.c_str()) == 0;
+						}
+
+						if(!sketch.initialize(base_file.c_str()))
+						{
+								return false;
+						}
+
+						std::string snapshot;
+						if(matched && apply_delta(delta_file.c_str(), sketch.table(), sketch.table_bytes(), snapshot))
+						{
+								std::istringstream in(snapshot, std::ios::binary);
+								load_state(in);
+						}
+						return true;
+				}
+};
+
+#endif /* CMS_ML_CHECKPOINTER_H_ */
@@ -2,7 +2,14 @@
 #define CMS_ML_CMS_H_
 
 #include "MurmurHash.h"
+#include "hash_family.h"
 #include "util.h"
+#include "table_memory.h"
+#include "checkpoint.h"
+#include "dirty_map.h"
+#include "counter.h"
+#include "simd.h"
+#include "median.h"
 
 #include <random>
 #include <climits>
@@ -22,10 +29,17 @@ struct hc
 		std::array<float, N> sign;
 };
 
-template<size_t N>
+/*
+   Count-Sketch with N rows
+   @param hash_t - hash family policy (see hash_family.h)
+   @param counter_t - counter storage format (see counter.h)
+ */
+template<size_t N, typename hash_t = murmur3_hash, typename counter_t = fp32_counter>
 class CMS
 {
-		private:
+		protected:
+				typedef typename counter_t::type value_t;
+
 				const size_t AVX = 8;
 				const size_t K;
 				const size_t D;
@@ -35,38 +49,145 @@ class CMS
 				const size_t NK;
 				const size_t SIZE;
 
-				float * data;
+				table_memory memory;
+				value_t * data;
 				uint32_t * seeds;
+				std::vector<hash_t> hashes;
 				__m256i mask;
 
+				// Blocks written since the last checkpoint - nullptr unless a checkpointer tracks the sketch
+				dirty_map* dirty;
+
+				/*
+				   Record a write of count counters starting at index
+				 */
+				void mark(const size_t index, const size_t count)
+				{
+						if(dirty)
+						{
+								dirty->mark(sizeof(value_t) * index, sizeof(value_t) * count);
+						}
+				}
+
+				/*
+				   Record a write of every class of a feature
+				 */
+				void mark(const hc<N>& cache)
+				{
+						for(size_t idx = 0; idx < N && dirty; ++idx)
+						{
+								mark(cache.hash[idx] * NK, NK);
+						}
+				}
+
+				/*
+				   Build the hash function for each row from the random seeds
+				 */
+				void seed_hashes()
+				{
+						hashes.clear();
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								hashes.emplace_back(seeds[idx]);
+						}
+				}
+
+				/*
+				   AVX-512 version of cms_retrieve(cache, logits) - 16 classes per step, the tail uses a mask register
+				 */
+				AVX512_TARGET void retrieve512(const hc<N>& cache, float* logits) const
+				{
+						for(size_t pos = 0; pos < K; pos += AVX512)
+						{
+								const __mmask16 tail = tail_mask(K - pos);
+								__m512 values[N];
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										const size_t index = cache.hash[idx] * NK + pos;
+										__m512 sign = _mm512_set1_ps(cache.sign[idx]);
+										values[idx] = _mm512_mul_ps(sign, counter_t::load512(&data[index], tail));
+								}
+								__m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(tail, logits + pos), median<N>(values));
+								_mm512_mask_storeu_ps(logits + pos, tail, sum);
+						}
+				}
+
+				/*
+				   AVX-512 version of cms_update(cache, gradient, scale)
+				 */
+				AVX512_TARGET void update512(const hc<N>& cache, const float* gradient, const float scale)
+				{
+						for(size_t pos = 0; pos < K; pos += AVX512)
+						{
+								const __mmask16 tail = tail_mask(K - pos);
+								__m512 value = _mm512_mul_ps(_mm512_set1_ps(scale), _mm512_maskz_loadu_ps(tail, gradient + pos));
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										const size_t index = cache.hash[idx] * NK + pos;
+										__m512 sign = _mm512_set1_ps(cache.sign[idx]);
+										__m512 current = counter_t::load512(&data[index], tail);
+										counter_t::store512(&data[index], tail, _mm512_fmadd_ps(sign, value, current));
+								}
+						}
+				}
+
+				/*
+				   AVX-512 version of cms_update_norm(cache, gradient, scale)
+				 */
+				AVX512_TARGET float update_norm512(const hc<N>& cache, const float* gradient, const float scale)
+				{
+						__m512 l1_norm = _mm512_setzero_ps();
+						for(size_t pos = 0; pos < K; pos += AVX512)
+						{
+								const __mmask16 tail = tail_mask(K - pos);
+								__m512 value = _mm512_mul_ps(_mm512_set1_ps(scale), _mm512_maskz_loadu_ps(tail, gradient + pos));
+								__m512 values[N];
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										const size_t index = cache.hash[idx] * NK + pos;
+										__m512 sign = _mm512_set1_ps(cache.sign[idx]);
+										__m512 result = _mm512_fmadd_ps(sign, value, counter_t::load512(&data[index], tail));
+										counter_t::store512(&data[index], tail, result);
+										values[idx] = _mm512_mul_ps(sign, result);
+								}
+								l1_norm = _mm512_add_ps(l1_norm, my_abs(median<N>(values)));
+						}
+						return reduce_add512(l1_norm);
+				}
+
+				/*
+				   Bucket and sign for one row from a single 64-bit hash
+				 */
+				void split(const size_t idx, const uint64_t hash, uint32_t& index, float& sign) const
+				{
+						index = idx * D + hash_t::index(hash, D);
+						sign = ((hash >> 32) & 0x1) ? 1.0 : -1.0;
+				}
+
 		public:
 				/*
 				   Initialize Memory and Random Seeds for Count-Sketch
 
 				   @param _K - Number of classes represented by Count-Sketch
 				   @param _D - Number of weights allocated for each class
+				   @param config - page and NUMA policies for the sketch memory
 				 */
-				CMS(size_t _K, size_t _D) :
+				CMS(size_t _K, size_t _D, const mem_config& config = mem_config()) :
 						K(_K),
 						D(_D),
 						DIV(K/AVX),
 						MOD(K%AVX),
 						CNT((MOD == 0) ? DIV : DIV+1),
 						NK(CNT*AVX),
-						SIZE(NK*N*D)
+						SIZE(NK*N*D),
+						memory(sizeof(value_t)*SIZE, config)
 						{
-								data = (float*) aligned_alloc(32, sizeof(float)*SIZE);
+								data = (value_t*) memory.data();
 								seeds = new uint32_t[N];
+								dirty = nullptr;
 
-								// Dynamic Mask
-								mask = _mm256_set1_epi32(0);
-								for(size_t idx = 0; idx < MOD; ++idx)
-								{
-										mask[idx] = -1;
-								}
-
-								// Clear Sketch
-								memset(data, 0, SIZE);
+								// Dynamic Mask - the first MOD float lanes
+								mask = lane_mask(MOD);
 
 								// Initialize seeds for universal hashing
 								std::default_random_engine generator;
@@ -75,11 +196,11 @@ class CMS
 								{
 										seeds[idx] = seed_gen(generator);
 								}
+								seed_hashes();
 						}
 
 				~CMS()
 				{
-						delete [] data;
 						delete [] seeds;
 				}
 
@@ -88,74 +209,61 @@ class CMS
 				 */
 				void clear()
 				{
-						memset(data, 0, sizeof(float) * SIZE);
+						memory.clear();
+						mark(0, SIZE);
 				}
 
 				/*
-				   Initialize Count-Sketch from a file
-				   @param filename - Count-Sketch Weight File
-				   @return true if successfully loaded weights from file
+				   Record the blocks changed by every update from now on - for incremental checkpoints
+				   @param map - dirty map sized for table_bytes(), or nullptr to stop tracking
 				 */
-				bool initialize(const char* filename)
+				void track(dirty_map* map)
 				{
-						std::string line;
-						std::ifstream myfile;
-						myfile.open (filename);
-						if(!myfile.is_open())
-						{
-								return false;
-						}
-						assert(myfile.is_open());
-
-						// Read Random Seeds
-						getline (myfile, line);
-						const size_t file_seeds = std::atol(line.c_str());
-						assert(file_seeds == N);
+						dirty = map;
+				}
 
-						for(size_t idx = 0; idx < N; ++idx)
-						{
-								getline (myfile, line);
-								seeds[idx] = std::atol(line.c_str());
-						}
+				/*
+				   @return the raw counters - for checkpoints
+				 */
+				void* table() const
+				{
+						return data;
+				}
 
-						// Read Sketch Values
-						getline (myfile, line);
-						const size_t file_sketch = std::atol(line.c_str());
-						assert(file_sketch == SIZE);
+				/*
+				   @return size of the raw counters in bytes
+				 */
+				size_t table_bytes() const
+				{
+						return sizeof(value_t) * SIZE;
+				}
 
-						for(size_t idx = 0; idx < SIZE; ++idx)
+				/*
+				   Initialize Count-Sketch from a checkpoint - the seeds are restored and the table is mapped from the file without a copy
+				   @param filename - Checkpoint File written by save()
+				   @return true if successfully loaded weights from file
+				 */
+				bool initialize(const char* filename)
+				{
+						checkpoint_reader reader(filename, checkpoint_kind::cms);
+						if(!reader.matches(K, D, N, SIZE, sizeof(value_t), hash_t::ID, counter_t::ID) || !reader.map(memory))
 						{
-								getline (myfile, line);
-								data[idx] = std::atof(line.c_str());
+								return false;
 						}
-						myfile.close();
+						std::copy(reader.file_seeds().begin(), reader.file_seeds().end(), seeds);
+						seed_hashes();
 						return true;
 				}
 
 				/*
-				   Save Count-Sketch weights to a file
-				   @param filename - Count-Sketch Weight File
+				   Save Count-Sketch weights to a binary checkpoint
+				   @param filename - Checkpoint File
+				   @return true if the checkpoint was written
 				 */
-				void save(const char* filename) const
+				bool save(const char* filename) const
 				{
-						std::ofstream myfile;
-						myfile.open (filename);
-						assert(myfile.is_open());
-
-						// Write Random Seeds
-						myfile << N << std::endl;
-						for(size_t idx = 0; idx < N; ++idx)
-						{
-								myfile << seeds[idx] << std::endl;
-						}
-
-						// Write Sketch Values
-						myfile << SIZE << std::endl;
-						for(size_t idx = 0; idx < SIZE; ++idx)
-						{
-								myfile << data[idx] << std::endl;
-						}
-						myfile.close();
+						const checkpoint_header header = make_header(checkpoint_kind::cms, hash_t::ID, counter_t::ID, sizeof(value_t), N, K, D, N, SIZE);
+						return write_checkpoint(filename, header, seeds, data);
 				}
 
 				/*
@@ -166,15 +274,17 @@ class CMS
 				 */
 				float update(const hc<N>& cache, const float value)
 				{
-						std::vector<float> values(N, 0);
+						float values[N];
 						for(size_t idx = 0; idx < N; ++idx)
 						{
 								int index = cache.hash[idx];
 								int sign = cache.sign[idx];
-								data[index] += sign * value;
-								values[idx] = sign * data[index];
+								const float current = counter_t::decode(data[index]) + sign * value;
+								data[index] = counter_t::update(current);
+								mark(index, 1);
+								values[idx] = sign * current;
 						}
-						return median(values);
+						return median<N>(values);
 				}
 
 				/*
@@ -185,12 +295,12 @@ class CMS
 				float retrieve(const hc<N>& cache) const
 				{
 						// For each hash function
-						std::vector<float> values(N, 0);
+						float values[N];
 						for(size_t idx = 0; idx < N; ++idx)
 						{
-								values[idx] = cache.sign[idx] * data[cache.hash[idx]];
+								values[idx] = cache.sign[idx] * counter_t::decode(data[cache.hash[idx]]);
 						}
-						return median(values);
+						return median<N>(values);
 				}
 
 				/*
@@ -202,18 +312,18 @@ class CMS
 				 */
 				float update(const void* key, const int len, float value)
 				{
-						std::vector<float> values(N, 0);
+						float values[N];
 						for(size_t idx = 0; idx < N; ++idx)
 						{
-								const uint32_t hash = MurmurHash3_x86_32 (key, len, seeds[idx]) % D;
-								const uint32_t index = idx * D + hash;
-
-								const bool sign_bit = MurmurHash3_x86_32 (key, len, seeds[idx]+3) & 0x1;
-								const float sign = (sign_bit) ? 1.0 : -1.0;
-								data[index] += sign * value;
-								values[idx] = sign * data[index];
+								uint32_t index;
+								float sign;
+								split(idx, hashes[idx](key, len), index, sign);
+								const float current = counter_t::decode(data[index]) + sign * value;
+								data[index] = counter_t::update(current);
+								mark(index, 1);
+								values[idx] = sign * current;
 						}
-						return median(values);
+						return median<N>(values);
 				}
 
 				/*
@@ -224,17 +334,15 @@ class CMS
 				 */
 				float retrieve(const void* key, const int len) const
 				{
-						std::vector<float> values(N, 0);
+						float values[N];
 						for(size_t idx = 0; idx < N; ++idx)
 						{
-								const uint32_t hash = MurmurHash3_x86_32 (key, len, seeds[idx]) % D;
-								const uint32_t index = idx * D + hash;
-
-								const bool sign_bit = MurmurHash3_x86_32 (key, len, seeds[idx]+3) & 0x1;
-								const float sign = (sign_bit) ? 1.0 : -1.0;
-								values[idx] = sign * data[index];
+								uint32_t index;
+								float sign;
+								split(idx, hashes[idx](key, len), index, sign);
+								values[idx] = sign * counter_t::decode(data[index]);
 						}
-						return median(values);
+						return median<N>(values);
 				}
 
 				/*
@@ -252,16 +360,17 @@ class CMS
 
 								if(cdx < DIV)
 								{
-										__m256 current = _mm256_load_ps( &data[index] );
+										__m256 current = counter_t::load( &data[index] );
 										__m256 result = _mm256_add_ps(current, _mm256_mul_ps(sign, value));
-										_mm256_store_ps(&data[index], result);
+										counter_t::store(&data[index], result);
 								}
 								else
 								{
-										__m256 current = _mm256_maskload_ps( &data[index], mask );
+										__m256 current = counter_t::load( &data[index], mask );
 										__m256 result = _mm256_add_ps(current, _mm256_mul_ps(sign, value));
-										_mm256_maskstore_ps(&data[index], mask, result);
+										counter_t::store(&data[index], mask, result);
 								}
+								mark(index, AVX);
 						}
 				}
 
@@ -280,16 +389,113 @@ class CMS
 
 								if(cdx < DIV)
 								{
-										__m256 w = _mm256_load_ps( &data[index] );
+										__m256 w = counter_t::load( &data[index] );
 										values[idx] = _mm256_mul_ps(sign, w);
 								}
 								else
 								{
-										__m256 w = _mm256_maskload_ps( &data[index], mask );
+										__m256 w = counter_t::load( &data[index], mask );
 										values[idx] = _mm256_mul_ps(sign, w);
 								}
 						}
-						return median(values[0], values[1], values[2]);
+						return median<N>(values);
+				}
+
+				/*
+				   Add the feature's weights for all classes to the logits - For Softmax Regression
+				   Uses 16-wide AVX-512 instructions when the CPU supports them
+				   @param cache - Cached indices and signs for the feature
+				   @param logits - logits for all K classes
+				 */
+				void cms_retrieve(const hc<N>& cache, float* logits) const
+				{
+						if(has_avx512())
+						{
+								retrieve512(cache, logits);
+								return;
+						}
+
+						for(size_t cdx = 0; cdx < CNT; ++cdx)
+						{
+								float* ptr = logits + cdx * AVX;
+								_mm256_storeu_ps(ptr, _mm256_add_ps(_mm256_loadu_ps(ptr), cms_retrieve(cache, cdx)));
+						}
+				}
+
+				/*
+				   Update the feature for all classes - For Softmax Regression
+				   Uses 16-wide AVX-512 instructions when the CPU supports them
+				   @param cache - Cached indices and signs for the feature
+				   @param gradient - gradient for all K classes
+				   @param scale - multiplier for the gradient, e.g. the negative learning rate
+				 */
+				void cms_update(const hc<N>& cache, const float* gradient, const float scale)
+				{
+						if(has_avx512())
+						{
+								update512(cache, gradient, scale);
+								mark(cache);
+								return;
+						}
+
+						__m256 scale_avx = _mm256_set1_ps(scale);
+						for(size_t cdx = 0; cdx < CNT; ++cdx)
+						{
+								cms_update(cache, cdx, _mm256_mul_ps(scale_avx, _mm256_loadu_ps(gradient + cdx * AVX)));
+						}
+				}
+
+				/*
+				   Update the feature for all classes and measure the updated weights in the same pass - For Softmax Regression
+				   The norm uses the fp32 values before they are rounded to the counter format
+				   @param cache - Cached indices and signs for the feature
+				   @param gradient - gradient for all K classes
+				   @param scale - multiplier for the gradient, e.g. the negative learning rate
+				   @return L1 norm of the feature's updated weights over all classes
+				 */
+				float cms_update_norm(const hc<N>& cache, const float* gradient, const float scale)
+				{
+						if(has_avx512())
+						{
+								const float result = update_norm512(cache, gradient, scale);
+								mark(cache);
+								return result;
+						}
+
+						__m256 scale_avx = _mm256_set1_ps(scale);
+						__m256 l1_norm = _mm256_set1_ps(0);
+						for(size_t cdx = 0; cdx < CNT; ++cdx)
+						{
+								__m256 value = _mm256_mul_ps(scale_avx, _mm256_loadu_ps(gradient + cdx * AVX));
+								__m256 values[N];
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										const size_t index = cache.hash[idx] * NK + cdx * AVX;
+										__m256 sign = _mm256_set1_ps(cache.sign[idx]);
+
+										if(cdx < DIV)
+										{
+												__m256 result = _mm256_add_ps(counter_t::load( &data[index] ), _mm256_mul_ps(sign, value));
+												counter_t::store(&data[index], result);
+												values[idx] = _mm256_mul_ps(sign, result);
+										}
+										else
+										{
+												__m256 result = _mm256_add_ps(counter_t::load( &data[index], mask ), _mm256_mul_ps(sign, value));
+												counter_t::store(&data[index], mask, result);
+												values[idx] = _mm256_and_ps(_mm256_mul_ps(sign, result), _mm256_castsi256_ps(mask));
+										}
+								}
+								l1_norm = _mm256_add_ps(l1_norm, my_abs(median<N>(values)));
+						}
+						mark(cache);
+
+						float result = 0.0;
+						for(size_t pos = 0; pos < AVX; ++pos)
+						{
+								result += l1_norm[pos];
+						}
+						return result;
 				}
 
 				/*
@@ -299,13 +505,21 @@ class CMS
 				 */
 				float cms_retrieve_single(const hc<N>& cache, const size_t class_idx) const
 				{
-						std::vector<float> values(N, 0);
+						float values[N];
 						for(size_t idx = 0; idx < N; ++idx)
 						{
 								const size_t index = cache.hash[idx] * NK + class_idx;
-								values[idx] = cache.sign[idx] * data[index];
+								values[idx] = cache.sign[idx] * counter_t::decode(data[index]);
 						}
-						return median(values);
+						return median<N>(values);
+				}
+
+				/*
+				   @return a fingerprint of the hash functions - identifies compatible cached hash indices
+				 */
+				uint32_t signature() const
+				{
+						return MurmurHash3_x86_32 (seeds, sizeof(uint32_t) * N, D ^ hash_t::ID ^ (counter_t::ID << 8));
 				}
 
 				/*
@@ -318,10 +532,41 @@ class CMS
 				{
 						for(size_t idx = 0; idx < N; ++idx)
 						{
-								const uint32_t hash = MurmurHash3_x86_32 (key, len, seeds[idx]) % D;
-								const bool sign_bit = MurmurHash3_x86_32 (key, len, seeds[idx]+3) & 0x1;
-								result.hash[idx] = idx * D + hash;
-								result.sign[idx] = (sign_bit) ? 1.0 : -1.0;
+								uint32_t index;
+								split(idx, hashes[idx](key, len), index, result.sign[idx]);
+								result.hash[idx] = index;
+						}
+				}
+
+				/*
+				   Precompute the Hash Index and Sign for many features - LANES keys per batched hash
+				   @param keys - pointers to feature representations
+				   @param len - length of every feature representation
+				   @param result - array of count structs to store the cached values
+				   @param count - number of features
+				 */
+				void hash(const void* const* keys, const int len, hc<N>* result, const size_t count)
+				{
+						uint64_t values[LANES];
+
+						size_t pos = 0;
+						for(; pos + LANES <= count; pos += LANES)
+						{
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										hashes[idx](keys + pos, len, values);
+										for(size_t ldx = 0; ldx < LANES; ++ldx)
+										{
+												uint32_t index;
+												split(idx, values[ldx], index, result[pos+ldx].sign[idx]);
+												result[pos+ldx].hash[idx] = index;
+										}
+								}
+						}
+
+						for(; pos < count; ++pos)
+						{
+								hash(keys[pos], len, result[pos]);
 						}
 				}
 };
@@ -0,0 +1,271 @@
+#ifndef CMS_ML_COUNTER_H_
+#define CMS_ML_COUNTER_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <functional>
+
+#include <immintrin.h>
+
+#include "simd.h"
+
+/*
+   Counter Formats - Storage policies for the Count-Sketch counters
+   Counters are widened to fp32 on load, so logits and medians are always computed in fp32
+   The 16-bit formats use stochastic rounding on store, so small gradient updates are preserved in expectation
+
+   Each policy provides
+     type - storage type of one counter
+     ID - identifies the format in the sketch signature
+     decode(x) / encode(x) - scalar conversion, encode rounds to nearest
+     update(x) - scalar conversion with stochastic rounding
+     load(ptr) / load(ptr, mask) - widen 8 counters to fp32, masked lanes read as zero
+     store(ptr, value) / store(ptr, mask, value) - narrow 8 fp32 values with stochastic rounding, masked lanes are unchanged
+     load512(ptr, mask) / store512(ptr, mask, value) - 16-lane AVX-512 versions, masked lanes are neither read nor written
+ */
+
+/*
+   Per-thread xorshift32 generator - 8 independent lanes of random bits for stochastic rounding
+ */
+inline __m256i random_bits()
+{
+		static thread_local bool seeded = false;
+		static thread_local __m256i state;
+		if(!seeded)
+		{
+				const uint32_t seed = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+				state = _mm256_set_epi32(seed * 0x9E3779B1, seed * 0x85EBCA77, seed * 0xC2B2AE3D, seed * 0x27D4EB2F,
+								seed * 0x165667B1, seed * 0xD3A2646C, seed * 0xFD7046C5, seed * 0xB55A4F09);
+				state = _mm256_or_si256(state, _mm256_set1_epi32(1));
+				seeded = true;
+		}
+		state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+		state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+		state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+		return state;
+}
+
+/*
+   16 lanes of random bits for the AVX-512 kernels
+ */
+AVX512_TARGET inline __m512i random_bits512()
+{
+		const __m256i low = random_bits();
+		const __m256i high = random_bits();
+		return _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1);
+}
+
+/*
+   Per-thread xorshift32 generator - scalar random bits for stochastic rounding
+ */
+inline uint32_t random_bit()
+{
+		static thread_local uint32_t state = 0;
+		if(state == 0)
+		{
+				state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+		}
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+}
+
+// Narrow 8 32-bit lanes holding 16-bit values into 8 consecutive 16-bit values
+inline __m128i narrow(const __m256i value, const bool is_signed)
+{
+		const __m256i packed = (is_signed) ? _mm256_packs_epi32(value, value) : _mm256_packus_epi32(value, value);
+		return _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0x08));
+}
+
+/*
+   FP32 - Full precision counters, the original format
+ */
+struct fp32_counter
+{
+		typedef float type;
+		static const uint32_t ID = 0;
+
+		static float decode(const type x) { return x; }
+		static type encode(const float x) { return x; }
+		static type update(const float x) { return x; }
+
+		static __m256 load(const type* ptr)
+		{
+				return _mm256_load_ps(ptr);
+		}
+
+		static __m256 load(const type* ptr, const __m256i mask)
+		{
+				return _mm256_maskload_ps(ptr, mask);
+		}
+
+		static void store(type* ptr, const __m256 value)
+		{
+				_mm256_store_ps(ptr, value);
+		}
+
+		static void store(type* ptr, const __m256i mask, const __m256 value)
+		{
+				_mm256_maskstore_ps(ptr, mask, value);
+		}
+
+		AVX512_TARGET static __m512 load512(const type* ptr, const __mmask16 mask)
+		{
+				return _mm512_maskz_loadu_ps(mask, ptr);
+		}
+
+		AVX512_TARGET static void store512(type* ptr, const __mmask16 mask, const __m512 value)
+		{
+				_mm512_mask_storeu_ps(ptr, mask, value);
+		}
+};
+
+/*
+   BF16 - The upper half of an fp32 value, same range with 8 bits of precision
+ */
+struct bf16_counter
+{
+		typedef uint16_t type;
+		static const uint32_t ID = 1;
+
+		static float decode(const type x)
+		{
+				const uint32_t bits = (uint32_t) x << 16;
+				float result;
+				memcpy(&result, &bits, sizeof(result));
+				return result;
+		}
+
+		static type encode(const float x)
+		{
+				uint32_t bits;
+				memcpy(&bits, &x, sizeof(bits));
+				return (bits + 0x7fff + ((bits >> 16) & 0x1)) >> 16;
+		}
+
+		static type update(const float x)
+		{
+				uint32_t bits;
+				memcpy(&bits, &x, sizeof(bits));
+				return (bits + (random_bit() & 0xffff)) >> 16;
+		}
+
+		static __m256 load(const type* ptr)
+		{
+				const __m256i wide = _mm256_cvtepu16_epi32(_mm_load_si128((const __m128i*) ptr));
+				return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+		}
+
+		static __m256 load(const type* ptr, const __m256i mask)
+		{
+				return _mm256_and_ps(load(ptr), _mm256_castsi256_ps(mask));
+		}
+
+		static void store(type* ptr, const __m256 value)
+		{
+				const __m256i noise = _mm256_srli_epi32(random_bits(), 16);
+				const __m256i bits = _mm256_add_epi32(_mm256_castps_si256(value), noise);
+				_mm_store_si128((__m128i*) ptr, narrow(_mm256_srli_epi32(bits, 16), false));
+		}
+
+		static void store(type* ptr, const __m256i mask, const __m256 value)
+		{
+				store(ptr, _mm256_blendv_ps(load(ptr), value, _mm256_castsi256_ps(mask)));
+		}
+
+		AVX512_TARGET static __m512 load512(const type* ptr, const __mmask16 mask)
+		{
+				const __m512i wide = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(mask, ptr));
+				return _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+		}
+
+		AVX512_TARGET static void store512(type* ptr, const __mmask16 mask, const __m512 value)
+		{
+				const __m512i noise = _mm512_srli_epi32(random_bits512(), 16);
+				const __m512i bits = _mm512_add_epi32(_mm512_castps_si512(value), noise);
+				_mm512_mask_cvtepi32_storeu_epi16(ptr, mask, _mm512_srli_epi32(bits, 16));
+		}
+};
+
+/*
+   Fixed Point - Signed 16-bit integers with FRAC fractional bits
+   Range is +-2^(15-FRAC) with a resolution of 2^-FRAC, values outside the range saturate
+ */
+template<int FRAC = 10>
+struct fixed16_counter
+{
+		typedef int16_t type;
+		static const uint32_t ID = 2 + (FRAC << 4);
+
+		static float decode(const type x)
+		{
+				return std::ldexp((float) x, -FRAC);
+		}
+
+		static type saturate(const float x)
+		{
+				return (type) std::max(-32768.0f, std::min(32767.0f, x));
+		}
+
+		static type encode(const float x)
+		{
+				return saturate(std::nearbyint(std::ldexp(x, FRAC)));
+		}
+
+		static type update(const float x)
+		{
+				const float uniform = (random_bit() >> 8) * (1.0f / (1 << 24));
+				return saturate(std::floor(std::ldexp(x, FRAC) + uniform));
+		}
+
+		static __m256 load(const type* ptr)
+		{
+				const __m256i wide = _mm256_cvtepi16_epi32(_mm_load_si128((const __m128i*) ptr));
+				return _mm256_mul_ps(_mm256_cvtepi32_ps(wide), _mm256_set1_ps(1.0f / (1 << FRAC)));
+		}
+
+		static __m256 load(const type* ptr, const __m256i mask)
+		{
+				return _mm256_and_ps(load(ptr), _mm256_castsi256_ps(mask));
+		}
+
+		static void store(type* ptr, const __m256 value)
+		{
+				// Uniform [0, 1) from the top 23 random bits
+				const __m256i mantissa = _mm256_or_si256(_mm256_srli_epi32(random_bits(), 9), _mm256_set1_epi32(0x3f800000));
+				const __m256 uniform = _mm256_sub_ps(_mm256_castsi256_ps(mantissa), _mm256_set1_ps(1.0f));
+
+				__m256 scaled = _mm256_mul_ps(value, _mm256_set1_ps((float) (1 << FRAC)));
+				scaled = _mm256_floor_ps(_mm256_add_ps(scaled, uniform));
+				scaled = _mm256_max_ps(_mm256_min_ps(scaled, _mm256_set1_ps(32767.0f)), _mm256_set1_ps(-32768.0f));
+				_mm_store_si128((__m128i*) ptr, narrow(_mm256_cvtps_epi32(scaled), true));
+		}
+
+		static void store(type* ptr, const __m256i mask, const __m256 value)
+		{
+				store(ptr, _mm256_blendv_ps(load(ptr), value, _mm256_castsi256_ps(mask)));
+		}
+
+		AVX512_TARGET static __m512 load512(const type* ptr, const __mmask16 mask)
+		{
+				const __m512i wide = _mm512_cvtepi16_epi32(_mm256_maskz_loadu_epi16(mask, ptr));
+				return _mm512_mul_ps(_mm512_cvtepi32_ps(wide), _mm512_set1_ps(1.0f / (1 << FRAC)));
+		}
+
+		AVX512_TARGET static void store512(type* ptr, const __mmask16 mask, const __m512 value)
+		{
+				const __m512i mantissa = _mm512_or_si512(_mm512_srli_epi32(random_bits512(), 9), _mm512_set1_epi32(0x3f800000));
+				const __m512 uniform = _mm512_sub_ps(_mm512_castsi512_ps(mantissa), _mm512_set1_ps(1.0f));
+
+				__m512 scaled = _mm512_mul_ps(value, _mm512_set1_ps((float) (1 << FRAC)));
+				scaled = _mm512_roundscale_ps(_mm512_add_ps(scaled, uniform), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+				scaled = _mm512_max_ps(_mm512_min_ps(scaled, _mm512_set1_ps(32767.0f)), _mm512_set1_ps(-32768.0f));
+				_mm512_mask_cvtsepi32_storeu_epi16(ptr, mask, _mm512_cvtps_epi32(scaled));
+		}
+};
+
+#endif /* CMS_ML_COUNTER_H_ */
@@ -0,0 +1,91 @@
+#ifndef CMS_ML_DIRTY_MAP_H_
+#define CMS_ML_DIRTY_MAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/*
+   Dirty Map - One bit per block of a weight table, set by the update kernels and cleared by the checkpointer
+   Setting a bit reads the word first, so the Hogwild workers only write the cache line the first time a block changes per checkpoint
+ */
+class dirty_map
+{
+		private:
+				const size_t shift;
+				const size_t blocks;
+				const size_t words;
+				std::unique_ptr<std::atomic<uint64_t>[]> bits;
+
+		public:
+				/*
+				   @param bytes - size of the tracked table
+				   @param block_bits - log2 of the block size in bytes
+				 */
+				dirty_map(const size_t bytes, const size_t block_bits = 12) :
+						shift(block_bits),
+						blocks((bytes + (1 << block_bits) - 1) >> block_bits),
+						words((blocks + 63) / 64),
+						bits(new std::atomic<uint64_t>[words])
+				{
+						for(size_t idx = 0; idx < words; ++idx)
+						{
+								bits[idx].store(0, std::memory_order_relaxed);
+						}
+				}
+
+				/*
+				   @param offset - first byte written
+				   @param bytes - number of bytes written
+				 */
+				void mark(const size_t offset, const size_t bytes)
+				{
+						const size_t last = (offset + bytes - 1) >> shift;
+						for(size_t block = offset >> shift; block <= last; ++block)
+						{
+								std::atomic<uint64_t>& word = bits[block / 64];
+								const uint64_t bit = 1ULL << (block % 64);
+								if(!(word.load(std::memory_order_relaxed) & bit))
+								{
+										word.fetch_or(bit, std::memory_order_relaxed);
+								}
+						}
+				}
+
+				/*
+				   Clear every bit and add the blocks that were dirty to a bitmap
+				   Blocks written after their word is cleared stay dirty for the next collect
+				   @param result - bitmap of words() words
+				 */
+				void collect(std::vector<uint64_t>& result)
+				{
+						result.resize(words, 0);
+						for(size_t idx = 0; idx < words; ++idx)
+						{
+								if(bits[idx].load(std::memory_order_relaxed))
+								{
+										result[idx] |= bits[idx].exchange(0, std::memory_order_acq_rel);
+								}
+						}
+				}
+
+				/*
+				   @return bytes per block
+				 */
+				size_t block_size() const
+				{
+						return (size_t) 1 << shift;
+				}
+
+				/*
+				   @return number of blocks in the table
+				 */
+				size_t size() const
+				{
+						return blocks;
+				}
+};
+
+#endif /* CMS_ML_DIRTY_MAP_H_ */
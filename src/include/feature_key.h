@@ -0,0 +1,260 @@
+#ifndef CMS_ML_FEATURE_KEY_H_
+#define CMS_ML_FEATURE_KEY_H_
+
+#include "mmap_parser.h"
+#include "hash_family.h"
+
+#include <stdint.h>
+#include <array>
+#include <string>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <istream>
+#include <functional>
+
+/*
+   Feature Keys - Representations of string features for the Top-K heaps, feature sets and queued examples
+     data_t - 32-byte null-terminated string, the original format
+     key16_t - 16-byte packed string, exact for features up to 16 bytes (the 12-byte DNA features)
+     fingerprint_t - 64-bit hash of the string, collisions are possible but rare - the names can be kept in a key_names side table
+   to_key<key_t>(token) converts a parsed token to any of them
+ */
+
+// Packed 16-byte key - zero padded, not null-terminated when the feature fills all 16 bytes
+typedef std::array<char, 16> key16_t;
+
+// 64-bit fingerprint key
+struct fingerprint_t
+{
+		uint64_t value;
+
+		bool operator==(const fingerprint_t& other) const { return value == other.value; }
+		bool operator<(const fingerprint_t& other) const { return value < other.value; }
+};
+
+namespace std
+{
+		template<>
+				struct hash<fingerprint_t>
+				{
+						size_t operator()(const fingerprint_t& item) const
+						{
+								return item.value;
+						}
+				};
+}
+
+// Fingerprints are exported as 16 hex digits when no names are kept
+inline std::ostream& operator<<(std::ostream& out, const fingerprint_t& key)
+{
+		char buf[17];
+		snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) key.value);
+		return out << buf;
+}
+
+/*
+   @param token - parsed feature
+   @return the feature in the key format
+ */
+template<typename key_t>
+key_t to_key(const token_t& token);
+
+template<>
+inline data_t to_key<data_t>(const token_t& token)
+{
+		return to_data(token);
+}
+
+template<>
+inline key16_t to_key<key16_t>(const token_t& token)
+{
+		key16_t result;
+		result.fill(0);
+		memcpy(result.data(), token.ptr, std::min(token.len, result.size()));
+		return result;
+}
+
+template<>
+inline fingerprint_t to_key<fingerprint_t>(const token_t& token)
+{
+		static const xxhash64 hasher(0x5eed);
+		return fingerprint_t{hasher(token.ptr, token.len)};
+}
+
+/*
+   Key Names - Optional side table from fingerprints back to the feature strings, for exporting selected features
+   Thread-safe, every distinct feature is stored once - the string keys carry their own names, so they are never stored
+   Names are appended to fixed-size chunks and never change, so save() runs alongside add() and only holds the lock to read the count
+ */
+class key_names
+{
+		private:
+				static const size_t CHUNK_BITS = 12;
+				static const size_t CHUNK = 1 << CHUNK_BITS;
+
+				struct entry
+				{
+						uint64_t key;
+						std::string name;
+				};
+
+				// index - fingerprint => position in the chunks
+				mutable std::mutex mtx;
+				std::unordered_map<uint64_t, size_t> index;
+				std::vector<std::unique_ptr<entry[]>> chunks;
+				size_t count = 0;
+
+				// Caller holds the lock
+				void append(const uint64_t key, std::string name)
+				{
+						if((count & (CHUNK-1)) == 0)
+						{
+								chunks.emplace_back(new entry[CHUNK]);
+						}
+						entry& item = chunks[count >> CHUNK_BITS][count & (CHUNK-1)];
+						item.key = key;
+						item.name = std::move(name);
+						index.emplace(key, count++);
+				}
+
+				const entry& at(const size_t pos) const
+				{
+						return chunks[pos >> CHUNK_BITS][pos & (CHUNK-1)];
+				}
+
+		public:
+				/*
+				   @param key - fingerprint of the feature
+				   @param token - parsed feature
+				 */
+				void add(const fingerprint_t& key, const token_t& token)
+				{
+						std::lock_guard<std::mutex> lock(mtx);
+						if(index.find(key.value) == index.end())
+						{
+								append(key.value, std::string(token.ptr, token.len));
+						}
+				}
+
+				template<size_t L>
+				void add(const std::array<char, L>& key, const token_t& token) {}
+
+				/*
+				   @param key - fingerprint of the feature
+				   @return the feature string, or the hex fingerprint if the feature was never added
+				 */
+				std::string operator()(const fingerprint_t& key) const
+				{
+						std::lock_guard<std::mutex> lock(mtx);
+						auto item = index.find(key.value);
+						if(item != index.end())
+						{
+								return at(item->second).name;
+						}
+
+						std::ostringstream out;
+						out << key;
+						return out.str();
+				}
+
+				template<size_t L>
+				std::string operator()(const std::array<char, L>& key) const
+				{
+						return std::string(key.data(), strnlen(key.data(), L));
+				}
+
+				/*
+				   @param key - fingerprint of the feature
+				   @return true if the feature string is known
+				 */
+				bool contains(const fingerprint_t& key) const
+				{
+						std::lock_guard<std::mutex> lock(mtx);
+						return index.find(key.value) != index.end();
+				}
+
+				template<size_t L>
+				bool contains(const std::array<char, L>& key) const
+				{
+						return true;
+				}
+
+				size_t size() const
+				{
+						std::lock_guard<std::mutex> lock(mtx);
+						return count;
+				}
+
+				/*
+				   Save the names in the order they were added - names added concurrently are included or not
+				   @param myfile - binary output stream
+				 */
+				void save(std::ostream& myfile) const
+				{
+						uint64_t total;
+						std::vector<const entry*> blocks;
+						{
+								std::lock_guard<std::mutex> lock(mtx);
+								total = count;
+								for(const auto& chunk : chunks)
+								{
+										blocks.push_back(chunk.get());
+								}
+						}
+
+						myfile.write((const char*) &total, sizeof(total));
+						for(size_t pos = 0; pos < total; ++pos)
+						{
+								const entry& item = blocks[pos >> CHUNK_BITS][pos & (CHUNK-1)];
+								const uint32_t len = item.name.size();
+								myfile.write((const char*) &item.key, sizeof(item.key));
+								myfile.write((const char*) &len, sizeof(len));
+								myfile.write(item.name.data(), len);
+						}
+				}
+
+				/*
+				   Add the names written by save()
+				   @param myfile - binary input stream
+				   @return true if every name was read
+				 */
+				bool load(std::istream& myfile)
+				{
+						uint64_t total;
+						if(!myfile.read((char*) &total, sizeof(total)))
+						{
+								return false;
+						}
+
+						std::lock_guard<std::mutex> lock(mtx);
+						for(size_t pos = 0; pos < total; ++pos)
+						{
+								uint64_t key;
+								uint32_t len;
+								if(!myfile.read((char*) &key, sizeof(key)) || !myfile.read((char*) &len, sizeof(len)))
+								{
+										return false;
+								}
+
+								std::string name(len, '\0');
+								if(!myfile.read(&name[0], len))
+								{
+										return false;
+								}
+								if(index.find(key) == index.end())
+								{
+										append(key, std::move(name));
+								}
+						}
+						return true;
+				}
+};
+
+#endif // CMS_ML_FEATURE_KEY_H_
@@ -0,0 +1,266 @@
+#ifndef CMS_ML_FEATURE_SET_H_
+#define CMS_ML_FEATURE_SET_H_
+
+#include "flat_table.h"
+#include "topk.h"
+#include "util.h"
+
+#include <vector>
+#include <array>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <fstream>
+#include <assert.h>
+
+#include <omp.h>
+
+// Score of a feature kept by several Top-K heaps
+enum class merge_score
+{
+		max,	// largest magnitude over the heaps
+		sum	// magnitudes summed over the heaps
+};
+
+/*
+   Frozen Feature Set - The per-thread Top-K heaps merged into one deduplicated, ranked set
+   Built after training, so evaluation needs one lookup per feature instead of one per heap
+   @param key_t - feature representation
+ */
+template<typename key_t>
+class feature_set
+{
+		public:
+				struct feature
+				{
+						key_t key;
+						float max;
+						float sum;
+						int heaps;
+				};
+
+		private:
+				// Number of hash partitions merged in parallel
+				static const size_t PARTS = 64;
+
+				// features - rank => merged feature
+				// dict - feature => <score, rank>
+				std::vector<feature> features;
+				flat_table<key_t> dict;
+
+				static bool by_key(const feature& a, const feature& b)
+				{
+						return a.key < b.key;
+				}
+
+				template<size_t L>
+				static void write_key(std::ofstream& myfile, const std::array<char, L>& key)
+				{
+						myfile.write(key.data(), strnlen(key.data(), L));
+				}
+
+				template<typename T>
+				static void write_key(std::ofstream& myfile, const T& key)
+				{
+						myfile << key;
+				}
+
+				/*
+				   k-way merge of sorted runs - equal keys from different heaps become one feature
+				   @param runs - runs sorted by key, one per heap
+				   @param result - merged features in key order
+				 */
+				static void merge_runs(const std::vector<const std::vector<feature>*>& runs, std::vector<feature>& result)
+				{
+						// <run, position> ordered by the key at that position, smallest first
+						typedef std::pair<size_t, size_t> head_t;
+						auto greater = [&](const head_t& a, const head_t& b)
+						{
+								return by_key((*runs[b.first])[b.second], (*runs[a.first])[a.second]);
+						};
+						std::priority_queue<head_t, std::vector<head_t>, decltype(greater)> heads(greater);
+
+						for(size_t run = 0; run < runs.size(); ++run)
+						{
+								if(!runs[run]->empty())
+								{
+										heads.push(std::make_pair(run, 0));
+								}
+						}
+
+						while(!heads.empty())
+						{
+								head_t head = heads.top();
+								heads.pop();
+
+								const feature& item = (*runs[head.first])[head.second];
+								if(!result.empty() && result.back().key == item.key)
+								{
+										feature& current = result.back();
+										current.max = std::max(current.max, item.max);
+										current.sum += item.sum;
+										current.heaps += item.heaps;
+								}
+								else
+								{
+										result.push_back(item);
+								}
+
+								if(++head.second < runs[head.first]->size())
+								{
+										heads.push(head);
+								}
+						}
+				}
+
+		public:
+				feature_set() {}
+
+				/*
+				   Merge the Top-K heaps and keep the best features
+				   @param heaps - independent Top-K heaps (TopK or BatchTopK), e.g. one per training thread
+				   @param limit - maximum number of features kept
+				   @param score - ranking of features kept by several heaps
+				   @param threads - number of threads for the merge
+				 */
+				template<typename heap_t>
+				void merge(const std::vector<heap_t>& heaps, const size_t limit, const merge_score score, const int threads)
+				{
+						const size_t H = heaps.size();
+
+						// Split each heap into hash partitions sorted by key
+						std::vector<std::array<std::vector<feature>, PARTS>> runs(H);
+						#pragma omp parallel for num_threads(threads)
+						for(size_t hdx = 0; hdx < H; ++hdx)
+						{
+								heaps[hdx].for_each([&](const key_t& key, const float value)
+								{
+										const float magnitude = my_abs(value);
+										runs[hdx][std::hash<key_t>()(key) % PARTS].push_back({key, magnitude, magnitude, 1});
+								});
+								for(auto& run : runs[hdx])
+								{
+										std::sort(run.begin(), run.end(), by_key);
+								}
+						}
+
+						// Each key lives in exactly one partition, so the partitions merge independently
+						std::array<std::vector<feature>, PARTS> merged;
+						#pragma omp parallel for num_threads(threads)
+						for(size_t part = 0; part < PARTS; ++part)
+						{
+								std::vector<const std::vector<feature>*> part_runs;
+								for(size_t hdx = 0; hdx < H; ++hdx)
+								{
+										part_runs.push_back(&runs[hdx][part]);
+								}
+								merge_runs(part_runs, merged[part]);
+						}
+
+						features.clear();
+						for(auto& part : merged)
+						{
+								features.insert(features.end(), part.begin(), part.end());
+						}
+
+						// Rank by score - ties keep key order, so the ranking is deterministic
+						auto rank = [&](const feature& a, const feature& b)
+						{
+								const float sa = (score == merge_score::max) ? a.max : a.sum;
+								const float sb = (score == merge_score::max) ? b.max : b.sum;
+								return (sa != sb) ? sa > sb : a.key < b.key;
+						};
+						if(features.size() > limit)
+						{
+								std::nth_element(features.begin(), features.begin() + limit, features.end(), rank);
+								features.resize(limit);
+						}
+						std::sort(features.begin(), features.end(), rank);
+
+						dict = flat_table<key_t>();
+						for(size_t idx = 0; idx < features.size(); ++idx)
+						{
+								typename flat_table<key_t>::entry& result = dict.insert(features[idx].key);
+								result.value = (score == merge_score::max) ? features[idx].max : features[idx].sum;
+								result.slot = idx;
+						}
+				}
+
+				/*
+				   @param key - feature representation
+				   @return true if the feature was selected
+				 */
+				bool find(const key_t& key) const
+				{
+						return dict.find(key) != nullptr;
+				}
+
+				/*
+				   @param key - feature representation
+				   @return the merged score of the feature, or 0 if it was not selected
+				 */
+				float operator[] (const key_t& key) const
+				{
+						const typename flat_table<key_t>::entry* item = dict.find(key);
+						return (item == nullptr) ? 0.0 : item->value;
+				}
+
+				/*
+				   Save the ranked features - one line per feature with the key, maximum score, summed score and number of heaps
+				   @param filename - Feature Selection File
+				 */
+				void save(const char* filename) const
+				{
+						std::ofstream myfile;
+						myfile.open (filename);
+						assert(myfile.is_open());
+
+						myfile << features.size() << std::endl;
+						for(const feature& item : features)
+						{
+								write_key(myfile, item.key);
+								myfile << "\t" << item.max << "\t" << item.sum << "\t" << item.heaps << std::endl;
+						}
+						myfile.close();
+				}
+
+				/*
+				   Save the ranked features with their names
+				   @param filename - Feature Selection File
+				   @param name - returns the string for a key, e.g. a key_names side table for fingerprint keys
+				 */
+				template<typename F>
+				void save(const char* filename, const F& name) const
+				{
+						std::ofstream myfile;
+						myfile.open (filename);
+						assert(myfile.is_open());
+
+						myfile << features.size() << std::endl;
+						for(const feature& item : features)
+						{
+								myfile << name(item.key) << "\t" << item.max << "\t" << item.sum << "\t" << item.heaps << std::endl;
+						}
+						myfile.close();
+				}
+
+				/*
+				   @param rank - position in the ranking, best first
+				   @return the selected feature
+				 */
+				const key_t& key(const size_t rank) const
+				{
+						return features[rank].key;
+				}
+
+				/*
+				   @return number of selected features
+				 */
+				size_t size() const
+				{
+						return features.size();
+				}
+};
+
+#endif // CMS_ML_FEATURE_SET_H_
@@ -0,0 +1,232 @@
+#ifndef CMS_ML_FLAT_TABLE_H_
+#define CMS_ML_FLAT_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <functional>
+
+/*
+   Flat Table - Open-addressing hash table with linear probing for the Top-K heaps
+   Each slot stores the key, its signed value and its position in the heap inline, so a lookup is a single probe sequence
+   Erase shifts the following entries back instead of leaving tombstones
+   The table starts small and doubles to stay at most half full, so sparse heaps stay small
+   @param key_t - feature representation, hashed with std::hash
+ */
+template<typename key_t>
+class flat_table
+{
+		public:
+				struct entry
+				{
+						key_t key;
+						float value;
+						int slot;
+				};
+
+		private:
+				// slot of an unused entry
+				static const int EMPTY = -1;
+				static const size_t MIN_CAPACITY = 16;
+
+				std::vector<entry> table;
+				size_t mask;
+				size_t count;
+
+				size_t home(const uint64_t hash) const
+				{
+						return hash & mask;
+				}
+
+				void allocate(const size_t capacity)
+				{
+						entry blank;
+						blank.value = 0;
+						blank.slot = EMPTY;
+						table.assign(capacity, blank);
+						mask = capacity - 1;
+						count = 0;
+				}
+
+				// Rehash every key into a table of the given capacity
+				void resize(const size_t capacity)
+				{
+						std::vector<entry> old;
+						old.swap(table);
+						allocate(capacity);
+						for(const entry& item : old)
+						{
+								if(item.slot != EMPTY)
+								{
+										entry& result = insert(item.key);
+										result.value = item.value;
+										result.slot = item.slot;
+								}
+						}
+				}
+
+		public:
+				flat_table()
+				{
+						allocate(MIN_CAPACITY);
+				}
+
+				/*
+				   Remove every key - the allocation is kept for reuse
+				 */
+				void clear()
+				{
+						for(entry& item : table)
+						{
+								item.slot = EMPTY;
+						}
+						count = 0;
+				}
+
+				/*
+				   Grow once so that size keys can be inserted without another resize
+				   @param size - number of keys
+				 */
+				void reserve(const size_t size)
+				{
+						size_t capacity = table.size();
+						while(capacity < 2 * size)
+						{
+								capacity <<= 1;
+						}
+						if(capacity != table.size())
+						{
+								resize(capacity);
+						}
+				}
+
+				/*
+				   std::hash is the identity for integers - finish with the Murmur3 64-bit mixer so consecutive keys spread over the table
+				   @param key - feature representation
+				   @return 64-bit hash of the key, can be computed once and reused for several lookups
+				 */
+				static uint64_t hash(const key_t& key)
+				{
+						uint64_t h = std::hash<key_t>()(key);
+						h ^= h >> 33;
+						h *= 0xff51afd7ed558ccdULL;
+						h ^= h >> 33;
+						h *= 0xc4ceb9fe1a85ec53ULL;
+						h ^= h >> 33;
+						return h;
+				}
+
+				/*
+				   @param key - feature representation
+				   @return the entry for the key, or nullptr if the key is not present
+				 */
+				entry* find(const key_t& key)
+				{
+						return find(key, hash(key));
+				}
+
+				const entry* find(const key_t& key) const
+				{
+						return const_cast<flat_table*>(this)->find(key, hash(key));
+				}
+
+				/*
+				   @param key - feature representation
+				   @param hash - hash(key)
+				   @return the entry for the key, or nullptr if the key is not present
+				 */
+				entry* find(const key_t& key, const uint64_t hash)
+				{
+						for(size_t pos = home(hash); table[pos].slot != EMPTY; pos = (pos + 1) & mask)
+						{
+								if(table[pos].key == key)
+								{
+										return &table[pos];
+								}
+						}
+						return nullptr;
+				}
+
+				const entry* find(const key_t& key, const uint64_t hash) const
+				{
+						return const_cast<flat_table*>(this)->find(key, hash);
+				}
+
+				/*
+				   Add a key that is not present in the table
+				   @param key - feature representation
+				   @return the new entry, the caller sets the value and heap slot
+				 */
+				entry& insert(const key_t& key)
+				{
+						return insert(key, hash(key));
+				}
+
+				/*
+				   @param key - feature representation
+				   @param hash - hash(key)
+				   @return the new entry, the caller sets the value and heap slot
+				 */
+				entry& insert(const key_t& key, const uint64_t hash)
+				{
+						if(2 * (count + 1) > table.size())
+						{
+								resize(table.size() * 2);
+						}
+
+						size_t pos = home(hash);
+						while(table[pos].slot != EMPTY)
+						{
+								pos = (pos + 1) & mask;
+						}
+						++count;
+						table[pos].key = key;
+						table[pos].slot = 0;
+						return table[pos];
+				}
+
+				/*
+				   Remove a key - the following entries of the probe sequence are shifted back into the hole
+				   @param key - feature representation
+				 */
+				void erase(const key_t& key)
+				{
+						entry* item = find(key);
+						if(item == nullptr)
+						{
+								return;
+						}
+
+						size_t hole = item - table.data();
+						for(size_t pos = (hole + 1) & mask; table[pos].slot != EMPTY; pos = (pos + 1) & mask)
+						{
+								// Move the entry if its home is not between the hole and its current position
+								const size_t target = home(hash(table[pos].key));
+								if(((pos - target) & mask) >= ((pos - hole) & mask))
+								{
+										table[hole] = table[pos];
+										hole = pos;
+								}
+						}
+						table[hole].slot = EMPTY;
+						--count;
+				}
+
+				/*
+				   @return number of keys in the table
+				 */
+				size_t size() const
+				{
+						return count;
+				}
+
+				/*
+				   @return number of entries allocated for the table
+				 */
+				size_t capacity() const
+				{
+						return table.size();
+				}
+};
+
+#endif // CMS_ML_FLAT_TABLE_H_
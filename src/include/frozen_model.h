@@ -0,0 +1,352 @@
+#ifndef CMS_ML_FROZEN_MODEL_H_
+#define CMS_ML_FROZEN_MODEL_H_
+
+#include "checkpoint.h"
+#include "flat_table.h"
+#include "topk.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <immintrin.h>
+#include <omp.h>
+
+/*
+   Frozen Model - Exact weights of the selected features, exported after training so inference needs neither the sketch nor the heaps
+   Test-time MISSION only reads the median K-vector of the features kept by the Top-K heaps, so those vectors are materialized once
+   into a dense table of cache-aligned rows, and an example is scored with one lookup and one row addition per feature
+   File Layout:
+     frozen_header, zero padded to FROZEN_ALIGN
+     weights[count][stride] - row r holds the K weights of feature r, zero padded to a multiple of 16 floats
+     keys[count] - feature of each row, zero padded to FROZEN_ALIGN
+     index[capacity] - open-addressing table of row + 1 (0 = empty), probed linearly from flat_table<key_t>::hash(key)
+   The file is the in-memory layout, so load() maps it read-only without parsing or copying
+ */
+const uint64_t FROZEN_MAGIC = 0x4e5a4f5246534d43;
+const uint32_t FROZEN_VERSION = 1;
+
+// Alignment of each section - one cache line
+const size_t FROZEN_ALIGN = 64;
+
+struct frozen_header
+{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t key_size;
+		uint64_t K;
+		uint64_t stride;
+		uint64_t count;
+		uint64_t capacity;
+		uint64_t keys;
+		uint64_t index;
+		uint64_t length;
+};
+
+/*
+   @param key_t - feature representation
+ */
+template<typename key_t>
+class frozen_model
+{
+		private:
+				static const size_t AVX = 8;
+
+				void* addr;
+				frozen_header header;
+				const float* weights;
+				const key_t* keys;
+				const uint32_t* index;
+
+				static size_t align(const size_t bytes)
+				{
+						return (bytes + FROZEN_ALIGN - 1) & ~(FROZEN_ALIGN - 1);
+				}
+
+				void attach()
+				{
+						const char* base = reinterpret_cast<const char*>(addr);
+						weights = reinterpret_cast<const float*>(base + align(sizeof(frozen_header)));
+						keys = reinterpret_cast<const key_t*>(base + header.keys);
+						index = reinterpret_cast<const uint32_t*>(base + header.index);
+				}
+
+				/*
+				   A corrupt header could make find() probe forever or read past the mapping
+				   @return true if the index has an empty slot and every section fits in the file
+				 */
+				static bool consistent(const frozen_header& file)
+				{
+						const uint64_t start = align(sizeof(frozen_header));
+						if(file.capacity == 0 || (file.capacity & (file.capacity - 1)) != 0 || file.count >= file.capacity
+										|| file.capacity > UINT32_MAX || file.stride < file.K || file.stride % 16 != 0
+										|| file.length < start)
+						{
+								return false;
+						}
+
+						// Each size is bounded by the file before it is multiplied, so nothing overflows
+						const uint64_t limit = file.length - start;
+						if(file.count != 0 && file.stride > limit / sizeof(float) / file.count)
+						{
+								return false;
+						}
+						const uint64_t keys = start + sizeof(float) * file.stride * file.count;
+						if(file.keys != keys || file.count > (file.length - keys) / sizeof(key_t))
+						{
+								return false;
+						}
+						const uint64_t index = keys + align(sizeof(key_t) * file.count);
+						return file.index == index && index <= file.length
+								&& file.capacity <= (file.length - index) / sizeof(uint32_t)
+								&& file.length == index + sizeof(uint32_t) * file.capacity;
+				}
+
+				void release()
+				{
+						if(addr)
+						{
+								munmap(addr, header.length);
+						}
+						addr = nullptr;
+						header = frozen_header();
+				}
+
+		public:
+				frozen_model() : addr(nullptr), header(), weights(nullptr), keys(nullptr), index(nullptr) {}
+
+				~frozen_model()
+				{
+						release();
+				}
+
+				frozen_model(const frozen_model&) = delete;
+				frozen_model& operator=(const frozen_model&) = delete;
+
+				/*
+				   Materialize the weights of the selected features
+				   @param features - selected features, each row is written in this order
+				   @param K - number of classes
+				   @param fill - adds the K weights of a feature to a zeroed row, called from several threads
+				   @param threads - number of threads filling rows
+				   @return true if the table was allocated
+				 */
+				template<typename F>
+				bool build(const std::vector<key_t>& features, const size_t K, F fill, const int threads)
+				{
+						release();
+
+						size_t capacity = 16;
+						while(capacity < 2 * features.size())
+						{
+								capacity <<= 1;
+						}
+
+						header.magic = FROZEN_MAGIC;
+						header.version = FROZEN_VERSION;
+						header.key_size = sizeof(key_t);
+						header.K = K;
+						header.stride = (K + 15) & ~15;
+						header.count = features.size();
+						header.capacity = capacity;
+						header.keys = align(sizeof(frozen_header)) + sizeof(float) * header.stride * header.count;
+						header.index = header.keys + align(sizeof(key_t) * header.count);
+						header.length = header.index + sizeof(uint32_t) * capacity;
+
+						// Anonymous memory is zeroed, so the padding and empty index slots need no initialization
+						addr = mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+						if(addr == MAP_FAILED)
+						{
+								addr = nullptr;
+								header = frozen_header();
+								return false;
+						}
+						char* base = reinterpret_cast<char*>(addr);
+						memcpy(base, &header, sizeof(header));
+						attach();
+
+						float* rows = const_cast<float*>(weights);
+						key_t* dst = const_cast<key_t*>(keys);
+						#pragma omp parallel for num_threads(threads)
+						for(size_t row = 0; row < features.size(); ++row)
+						{
+								dst[row] = features[row];
+								fill(features[row], rows + row * header.stride);
+						}
+
+						uint32_t* slots = const_cast<uint32_t*>(index);
+						const size_t mask = capacity - 1;
+						for(size_t row = 0; row < features.size(); ++row)
+						{
+								size_t pos = flat_table<key_t>::hash(features[row]) & mask;
+								while(slots[pos] != 0)
+								{
+										pos = (pos + 1) & mask;
+								}
+								slots[pos] = row + 1;
+						}
+						return true;
+				}
+
+				/*
+				   Write the model - the file is written next to the target and renamed
+				   @param filename - Frozen Model File
+				   @return true if the model was written
+				 */
+				bool save(const char* filename) const
+				{
+						if(!addr)
+						{
+								return false;
+						}
+
+						const std::string tmp = std::string(filename) + ".tmp";
+						const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+						if(fd < 0)
+						{
+								return false;
+						}
+
+						const bool status = write_all(fd, addr, header.length) && fdatasync(fd) == 0;
+						close(fd);
+						if(!status || rename(tmp.c_str(), filename) != 0)
+						{
+								unlink(tmp.c_str());
+								return false;
+						}
+						return true;
+				}
+
+				/*
+				   Map a model written by save()
+				   @param filename - Frozen Model File
+				   @return true if the file is a frozen model for key_t
+				 */
+				bool load(const char* filename)
+				{
+						release();
+
+						const int fd = open(filename, O_RDONLY);
+						if(fd < 0)
+						{
+								return false;
+						}
+
+						frozen_header file;
+						struct stat sb;
+						const bool valid = pread(fd, &file, sizeof(file), 0) == sizeof(file) && fstat(fd, &sb) == 0
+								&& file.magic == FROZEN_MAGIC && file.version == FROZEN_VERSION && file.key_size == sizeof(key_t)
+								&& (size_t) sb.st_size >= file.length && consistent(file);
+						if(!valid)
+						{
+								close(fd);
+								return false;
+						}
+
+						addr = mmap(NULL, file.length, PROT_READ, MAP_PRIVATE, fd, 0);
+						close(fd);
+						if(addr == MAP_FAILED)
+						{
+								addr = nullptr;
+								return false;
+						}
+						madvise(addr, file.length, MADV_WILLNEED);
+
+						header = file;
+						attach();
+
+						// Every slot must name a row, and an empty slot must end every probe sequence
+						size_t used = 0;
+						for(size_t pos = 0; pos < header.capacity; ++pos)
+						{
+								used += (index[pos] != 0);
+								if(index[pos] > header.count)
+								{
+										release();
+										return false;
+								}
+						}
+						if(used != header.count)
+						{
+								release();
+								return false;
+						}
+						return true;
+				}
+
+				/*
+				   @param key - feature representation
+				   @return the weights of the feature, or nullptr if it was not selected
+				 */
+				const float* find(const key_t& key) const
+				{
+						const size_t mask = header.capacity - 1;
+						for(size_t pos = flat_table<key_t>::hash(key) & mask; index[pos] != 0; pos = (pos + 1) & mask)
+						{
+								const uint32_t row = index[pos] - 1;
+								if(keys[row] == key)
+								{
+										return weights + row * header.stride;
+								}
+						}
+						return nullptr;
+				}
+
+				/*
+				   Add the weights of a feature to the logits - nothing is added for features that were not selected
+				   @param key - feature representation
+				   @param logits - K logits padded to a multiple of 8
+				 */
+				void retrieve(const key_t& key, float* logits) const
+				{
+						const float* row = find(key);
+						if(row == nullptr)
+						{
+								return;
+						}
+
+						for(size_t pos = 0; pos < header.K; pos += AVX)
+						{
+								_mm256_storeu_ps(logits + pos, _mm256_add_ps(_mm256_loadu_ps(logits + pos), _mm256_load_ps(row + pos)));
+						}
+				}
+
+				/*
+				   @return number of features
+				 */
+				size_t size() const
+				{
+						return header.count;
+				}
+
+				/*
+				   @return number of classes
+				 */
+				size_t classes() const
+				{
+						return header.K;
+				}
+
+				/*
+				   @return bytes of the weights, keys and index
+				 */
+				size_t memory() const
+				{
+						return header.length;
+				}
+
+				explicit operator bool() const
+				{
+						return addr != nullptr;
+				}
+};
+
+#endif /* CMS_ML_FROZEN_MODEL_H_ */
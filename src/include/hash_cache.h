@@ -0,0 +1,295 @@
+#ifndef CMS_ML_HASH_CACHE_H_
+#define CMS_ML_HASH_CACHE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+/*
+   Hash Cache - Binary dataset with precomputed hash indices for each feature
+   File Layout:
+     cache_header
+     For each example - label, size, features[size], keys[size * key_size] padded to 4 bytes
+   The keys are stored in the feature key format of the trainer, key_size = sizeof(key_t), so a cached example
+   finds the same keys in the Top-K heaps as the tokens it was built from - truncated or padded strings would not
+   The header records the size and modification time of the data file, so a cache is rebuilt when its data file changes
+   The cache is written next to its final name and renamed once complete, so a failed write never leaves a truncated cache
+ */
+const uint64_t CACHE_MAGIC = 0x4548434143534d43;
+const uint32_t CACHE_VERSION = 3;
+
+struct cache_header
+{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t feature_size;
+		uint32_t key_size;
+		uint32_t signature;
+		uint64_t examples;
+		uint64_t source_size;
+		int64_t source_mtime;
+};
+
+/*
+   @param source - data file
+   @param size - size of the data file in bytes
+   @param mtime - modification time of the data file in nanoseconds
+   @return true if the data file exists
+ */
+inline bool source_stamp(const char* source, uint64_t& size, int64_t& mtime)
+{
+		struct stat sb;
+		if(stat(source, &sb) != 0)
+		{
+				return false;
+		}
+		size = sb.st_size;
+		mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+		return true;
+}
+
+template<typename T>
+struct cached_example
+{
+		uint32_t label;
+		uint32_t size;
+		const T* features;
+		const char* keys;
+
+		/*
+		   @param idx - feature index
+		   @return the feature key - key_t must be the key format the cache was written with
+		 */
+		template<typename key_t>
+		key_t key(const size_t idx) const
+		{
+				key_t result;
+				memcpy(&result, keys + idx * sizeof(key_t), sizeof(key_t));
+				return result;
+		}
+};
+
+template<typename T>
+class hash_cache_writer
+{
+		private:
+				const uint32_t key_size;
+				const std::string target;
+				const std::string tmp;
+				std::vector<char> buffer;
+				std::ofstream myfile;
+				cache_header header;
+				bool finished;
+
+		public:
+				/*
+				   @param filename - Hash Cache File
+				   @param _key_size - bytes stored for each feature key, sizeof(key_t) (0 for none)
+				   @param signature - identifies the hash functions used for the features
+				   @param source - data file the cache is built from
+				 */
+				hash_cache_writer(const char* filename, const uint32_t _key_size, const uint32_t signature, const char* source) :
+						key_size(_key_size),
+						target(filename),
+						tmp(target + ".tmp"),
+						buffer(1 << 24),
+						header(),
+						finished(false)
+				{
+						myfile.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+						myfile.open(tmp, std::ios::binary | std::ios::trunc);
+
+						header.magic = CACHE_MAGIC;
+						header.version = CACHE_VERSION;
+						header.feature_size = sizeof(T);
+						header.key_size = key_size;
+						header.signature = signature;
+						header.examples = 0;
+						if(!source_stamp(source, header.source_size, header.source_mtime))
+						{
+								myfile.setstate(std::ios::failbit);
+						}
+						myfile.write((const char*) &header, sizeof(header));
+				}
+
+				// An unfinished cache is discarded
+				~hash_cache_writer()
+				{
+						if(!finished)
+						{
+								myfile.close();
+								unlink(tmp.c_str());
+						}
+				}
+
+				/*
+				   Record the number of examples and move the cache to its final name
+				   @return true if every write succeeded
+				 */
+				bool finish()
+				{
+						finished = true;
+						myfile.seekp(0);
+						myfile.write((const char*) &header, sizeof(header));
+						myfile.close();
+						if(myfile.fail() || rename(tmp.c_str(), target.c_str()) != 0)
+						{
+								unlink(tmp.c_str());
+								return false;
+						}
+						return true;
+				}
+
+				/*
+				   Append an example to the cache
+				   @param label - class label for the example
+				   @param features - precomputed hash values for each feature
+				   @param keys - feature keys, key_size bytes each
+				   @param size - number of features
+				 */
+				void write(const uint32_t label, const T* features, const char* keys, const uint32_t size)
+				{
+						myfile.write((const char*) &label, sizeof(label));
+						myfile.write((const char*) &size, sizeof(size));
+						myfile.write((const char*) features, sizeof(T) * size);
+
+						const size_t bytes = key_size * size;
+						const char padding[4] = {0, 0, 0, 0};
+						myfile.write(keys, bytes);
+						myfile.write(padding, (4 - bytes % 4) % 4);
+						++header.examples;
+				}
+};
+
+template<typename T>
+class hash_cache_reader
+{
+		private:
+				bool status;
+				size_t length;
+				void* addr;
+				cache_header header;
+				std::vector<size_t> offsets;
+
+		public:
+				/*
+				   Map the cache into memory and index the start of each example
+				   @param filename - Hash Cache File
+				   @param key_size - expected bytes stored for each feature key, sizeof(key_t)
+				   @param signature - expected hash function signature
+				   @param source - data file the cache must have been built from, as it is now
+				 */
+				hash_cache_reader(const char* filename, const uint32_t key_size, const uint32_t signature, const char* source) : status(false), length(0), addr(nullptr)
+				{
+						uint64_t source_size;
+						int64_t source_mtime;
+						if(!source_stamp(source, source_size, source_mtime))
+						{
+								return;
+						}
+
+						int fd = open(filename, O_RDONLY);
+						if(fd < 0)
+						{
+								return;
+						}
+
+						struct stat sb;
+						if(fstat(fd, &sb) != 0 || (size_t) sb.st_size < sizeof(cache_header))
+						{
+								close(fd);
+								return;
+						}
+						length = sb.st_size;
+
+						addr = mmap(NULL, length, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+						close(fd);
+						if (addr == MAP_FAILED)
+						{
+								std::cout << "MMAP Failure" << std::endl;
+								addr = nullptr;
+								return;
+						}
+						madvise(addr, length, MADV_SEQUENTIAL);
+						madvise(addr, length, MADV_WILLNEED);
+
+						memcpy(&header, addr, sizeof(header));
+						if(header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.feature_size != sizeof(T)
+										|| header.key_size != key_size || header.signature != signature
+										|| header.source_size != source_size || header.source_mtime != source_mtime)
+						{
+								return;
+						}
+
+						// Index Examples
+						const char* base = reinterpret_cast<const char*>(addr);
+						size_t pos = sizeof(header);
+						offsets.reserve(header.examples);
+						for(size_t idx = 0; idx < header.examples; ++idx)
+						{
+								if(pos + 2 * sizeof(uint32_t) > length)
+								{
+										return;
+								}
+								uint32_t size;
+								memcpy(&size, base + pos + sizeof(uint32_t), sizeof(size));
+								offsets.push_back(pos);
+
+								const size_t bytes = key_size * size;
+								pos += 2 * sizeof(uint32_t) + sizeof(T) * size + bytes + (4 - bytes % 4) % 4;
+						}
+						status = (pos == length);
+				}
+
+				~hash_cache_reader()
+				{
+						if(addr)
+						{
+								munmap(addr, length);
+						}
+				}
+
+				/*
+				   @param idx - example index
+				   @return a view of the example inside the mapped cache
+				 */
+				cached_example<T> operator[](const size_t idx) const
+				{
+						const char* ptr = reinterpret_cast<const char*>(addr) + offsets[idx];
+
+						cached_example<T> result;
+						memcpy(&result.label, ptr, sizeof(uint32_t));
+						memcpy(&result.size, ptr + sizeof(uint32_t), sizeof(uint32_t));
+						result.features = reinterpret_cast<const T*>(ptr + 2 * sizeof(uint32_t));
+						result.keys = reinterpret_cast<const char*>(result.features + result.size);
+						return result;
+				}
+
+				/*
+				   @return number of examples in the cache
+				 */
+				size_t size() const
+				{
+						return offsets.size();
+				}
+
+				/*
+				   @return true if the cache is complete and matches the expected hash functions and data file
+				 */
+				operator bool() const
+				{
+						return status;
+				}
+};
+
+#endif /* CMS_ML_HASH_CACHE_H_ */
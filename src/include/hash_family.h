@@ -0,0 +1,274 @@
+#ifndef CMS_ML_HASH_FAMILY_H_
+#define CMS_ML_HASH_FAMILY_H_
+
+#include "MurmurHash.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+#include <vector>
+
+/*
+   Hash Families - Policies that map a feature to 64 random bits for one row of a sketch
+   The low 32 bits select the bucket and bit 32 selects the sign
+
+   Each policy provides
+     operator()(key, len) - 64-bit hash of one feature
+     operator()(keys, len, result) - 64-bit hashes of LANES features
+     bucket(key, len, D) - bucket of one feature when no sign is needed
+     bucket(keys, len, D, result) - buckets of LANES features
+     index(hash, D) - reduce a 64-bit hash to a bucket in [0, D)
+ */
+const size_t LANES = 8;
+
+/*
+   Map the low 32 bits of a hash to [0, D) without an integer division
+   Power-of-two tables use a mask, other sizes use a multiply-shift
+ */
+inline uint32_t reduce(const uint64_t hash, const size_t D)
+{
+		if((D & (D-1)) == 0)
+		{
+				return hash & (D-1);
+		}
+		return ((hash & 0xffffffff) * D) >> 32;
+}
+
+/*
+   MurmurHash3 - Compatible with models trained before hash families existed
+   The sign comes from a second evaluation with seed+3 and the bucket uses modulo D
+ */
+struct murmur3_hash
+{
+		static const uint32_t ID = 0;
+		uint32_t seed;
+
+		murmur3_hash(const uint32_t _seed = 0) : seed(_seed) {}
+
+		uint64_t operator()(const void* key, const int len) const
+		{
+				const uint64_t sign = MurmurHash3_x86_32 (key, len, seed+3);
+				return (sign << 32) | MurmurHash3_x86_32 (key, len, seed);
+		}
+
+		void operator()(const void* const* keys, const int len, uint64_t* result) const
+		{
+				uint32_t hashes[LANES];
+				uint32_t signs[LANES];
+				MurmurHash3_x86_32_x8 (keys, len, seed, hashes);
+				MurmurHash3_x86_32_x8 (keys, len, seed+3, signs);
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] = ((uint64_t) signs[idx] << 32) | hashes[idx];
+				}
+		}
+
+		uint32_t bucket(const void* key, const int len, const size_t D) const
+		{
+				return MurmurHash3_x86_32 (key, len, seed) % D;
+		}
+
+		void bucket(const void* const* keys, const int len, const size_t D, uint32_t* result) const
+		{
+				MurmurHash3_x86_32_x8 (keys, len, seed, result);
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] %= D;
+				}
+		}
+
+		static uint32_t index(const uint64_t hash, const size_t D)
+		{
+				return (uint32_t) hash % D;
+		}
+};
+
+/*
+   xxHash64 - One 64-bit evaluation per row
+ */
+struct xxhash64
+{
+		static const uint32_t ID = 1;
+		uint64_t seed;
+
+		static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+		static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+		static const uint64_t P3 = 0x165667B19E3779F9ULL;
+		static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+		static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+		xxhash64(const uint32_t _seed = 0) : seed(_seed) {}
+
+		static uint64_t rotl(const uint64_t x, const int r)
+		{
+				return (x << r) | (x >> (64 - r));
+		}
+
+		static uint64_t round(uint64_t acc, const uint64_t input)
+		{
+				acc += input * P2;
+				acc = rotl(acc, 31);
+				return acc * P1;
+		}
+
+		static uint64_t merge(uint64_t acc, const uint64_t value)
+		{
+				acc ^= round(0, value);
+				return acc * P1 + P4;
+		}
+
+		uint64_t operator()(const void* key, const int len) const
+		{
+				const uint8_t* ptr = (const uint8_t*) key;
+				const uint8_t* end = ptr + len;
+				uint64_t h;
+
+				if(len >= 32)
+				{
+						uint64_t v1 = seed + P1 + P2;
+						uint64_t v2 = seed + P2;
+						uint64_t v3 = seed;
+						uint64_t v4 = seed - P1;
+						for(; ptr + 32 <= end; ptr += 32)
+						{
+								uint64_t lanes[4];
+								memcpy(lanes, ptr, sizeof(lanes));
+								v1 = round(v1, lanes[0]);
+								v2 = round(v2, lanes[1]);
+								v3 = round(v3, lanes[2]);
+								v4 = round(v4, lanes[3]);
+						}
+						h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+						h = merge(h, v1);
+						h = merge(h, v2);
+						h = merge(h, v3);
+						h = merge(h, v4);
+				}
+				else
+				{
+						h = seed + P5;
+				}
+
+				h += (uint64_t) len;
+				for(; ptr + 8 <= end; ptr += 8)
+				{
+						uint64_t k1;
+						memcpy(&k1, ptr, sizeof(k1));
+						h ^= round(0, k1);
+						h = rotl(h, 27) * P1 + P4;
+				}
+
+				if(ptr + 4 <= end)
+				{
+						uint32_t k1;
+						memcpy(&k1, ptr, sizeof(k1));
+						h ^= (uint64_t) k1 * P1;
+						h = rotl(h, 23) * P2 + P3;
+						ptr += 4;
+				}
+
+				for(; ptr < end; ++ptr)
+				{
+						h ^= (*ptr) * P5;
+						h = rotl(h, 11) * P1;
+				}
+
+				// Avalanche
+				h ^= h >> 33;
+				h *= P2;
+				h ^= h >> 29;
+				h *= P3;
+				h ^= h >> 32;
+				return h;
+		}
+
+		void operator()(const void* const* keys, const int len, uint64_t* result) const
+		{
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] = (*this)(keys[idx], len);
+				}
+		}
+
+		uint32_t bucket(const void* key, const int len, const size_t D) const
+		{
+				return reduce((*this)(key, len), D);
+		}
+
+		void bucket(const void* const* keys, const int len, const size_t D, uint32_t* result) const
+		{
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] = bucket(keys[idx], len, D);
+				}
+		}
+
+		static uint32_t index(const uint64_t hash, const size_t D)
+		{
+				return reduce(hash, D);
+		}
+};
+
+/*
+   Simple Tabulation Hashing - One random 64-bit word per (byte position, byte value)
+   Positions beyond WIDTH wrap around, so keys should be at most WIDTH bytes
+ */
+struct tabulation_hash
+{
+		static const uint32_t ID = 2;
+		static const size_t WIDTH = 32;
+		std::vector<uint64_t> table;
+
+		tabulation_hash(const uint32_t seed = 0) : table(WIDTH * 256)
+		{
+				// SplitMix64 random table
+				uint64_t state = seed;
+				for(auto& item : table)
+				{
+						state += 0x9E3779B97F4A7C15ULL;
+						uint64_t z = state;
+						z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+						z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+						item = z ^ (z >> 31);
+				}
+		}
+
+		uint64_t operator()(const void* key, const int len) const
+		{
+				const uint8_t* ptr = (const uint8_t*) key;
+				uint64_t h = 0;
+				for(int idx = 0; idx < len; ++idx)
+				{
+						h ^= table[(idx % WIDTH) * 256 + ptr[idx]];
+				}
+				return h;
+		}
+
+		void operator()(const void* const* keys, const int len, uint64_t* result) const
+		{
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] = (*this)(keys[idx], len);
+				}
+		}
+
+		uint32_t bucket(const void* key, const int len, const size_t D) const
+		{
+				return reduce((*this)(key, len), D);
+		}
+
+		void bucket(const void* const* keys, const int len, const size_t D, uint32_t* result) const
+		{
+				for(size_t idx = 0; idx < LANES; ++idx)
+				{
+						result[idx] = bucket(keys[idx], len, D);
+				}
+		}
+
+		static uint32_t index(const uint64_t hash, const size_t D)
+		{
+				return reduce(hash, D);
+		}
+};
+
+#endif /* CMS_ML_HASH_FAMILY_H_ */
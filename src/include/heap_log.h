@@ -0,0 +1,117 @@
+#ifndef CMS_ML_HEAP_LOG_H_
+#define CMS_ML_HEAP_LOG_H_
+
+#include "checkpoint.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <ostream>
+
+/*
+   Heap Log - Changes of one Top-K heap since the previous checkpoint, copied by the heap's collect() in the checkpoint pause
+   The heaps mark each slot whose feature or value changed in a bitmap, so the pause copies only those slots
+   and the features buffered since the last log, instead of the whole heap
+   @param size - number of slots in the heap
+   @param changes - slot, feature and signed value of each changed slot
+   @param pending_from - number of buffered features of the previous log that are still buffered, 0 after a flush
+   @param pending - features buffered since the previous log
+ */
+template<typename key_t>
+struct heap_log
+{
+		struct change
+		{
+				uint32_t slot;
+				key_t key;
+				float value;
+		};
+
+		struct item
+		{
+				key_t key;
+				float value;
+		};
+
+		size_t size = 0;
+		std::vector<change> changes;
+		size_t pending_from = 0;
+		std::vector<item> pending;
+};
+
+/*
+   Heap Mirror - Keys and values of a Top-K heap as of the last applied log, kept by the checkpointer thread
+   Only the slots are mirrored, not the dict, filter or hashes of the heap, and it is saved in the save_heap format
+ */
+template<typename key_t>
+class heap_mirror
+{
+		private:
+				std::vector<key_t> keys;
+				std::vector<float> values;
+				std::vector<typename heap_log<key_t>::item> buffer;
+
+		public:
+				/*
+				   Apply the changes of a log - the log is emptied and its memory released for the next pause
+				   @param log - changes collected from the heap in the pause
+				 */
+				void apply(heap_log<key_t>& log)
+				{
+						keys.resize(log.size);
+						values.resize(log.size);
+						for(const auto& item : log.changes)
+						{
+								keys[item.slot] = item.key;
+								values[item.slot] = item.value;
+						}
+
+						buffer.resize(log.pending_from);
+						buffer.insert(buffer.end(), log.pending.begin(), log.pending.end());
+
+						std::vector<typename heap_log<key_t>::change>().swap(log.changes);
+						std::vector<typename heap_log<key_t>::item>().swap(log.pending);
+				}
+
+				/*
+				   Visit every feature of the mirrored set
+				   @param func - called with the key and the signed value of each feature
+				 */
+				template<typename F>
+				void for_each(F func) const
+				{
+						for(size_t idx = 0; idx < keys.size(); ++idx)
+						{
+								func(keys[idx], values[idx]);
+						}
+				}
+
+				/*
+				   Visit every mirrored buffered feature
+				   @param func - called with the key and the signed value of each feature
+				 */
+				template<typename F>
+				void for_each_pending(F func) const
+				{
+						for(const auto& item : buffer)
+						{
+								func(item.key, item.value);
+						}
+				}
+
+				/*
+				   Save the mirrored heap - the same stream as the heap's own save()
+				   @param myfile - binary output stream
+				 */
+				void save(std::ostream& myfile) const
+				{
+						save_heap<key_t>(myfile, *this);
+				}
+
+				size_t size() const
+				{
+						return keys.size();
+				}
+};
+
+#endif /* CMS_ML_HEAP_LOG_H_ */
@@ -0,0 +1,214 @@
+#ifndef CMS_ML_INTERN_TABLE_H_
+#define CMS_ML_INTERN_TABLE_H_
+
+#include "flat_table.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <istream>
+#include <ostream>
+#include <assert.h>
+
+/*
+   Intern Table - Concurrent dictionary that maps each distinct feature to a 32-bit id
+   Shared by the per-class Top-K heaps of fine-grained MISSION, so a feature kept by many classes is stored once
+   and each heap only stores ids and values
+   The table is split into SHARDS shards by the high bits of the hash, each with its own lock and flat_table
+   Ids are never reused - id => feature is kept in fixed-size chunks, so the key array never moves while it grows
+   @param key_t - feature representation
+ */
+template<typename key_t>
+class intern_table
+{
+		public:
+				// id of a feature that was never interned
+				static const uint32_t NONE = UINT32_MAX;
+
+		private:
+				static const size_t SHARD_BITS = 6;
+				static const size_t SHARDS = 1 << SHARD_BITS;
+				static const size_t CHUNK_BITS = 12;
+				static const size_t CHUNK = 1 << CHUNK_BITS;
+				static const size_t MAX_LOCAL = (size_t) 1 << (32 - SHARD_BITS);
+
+				typedef typename flat_table<key_t>::entry entry;
+
+				// dict - feature => <unused, local id>
+				// chunks - local id => feature
+				struct shard
+				{
+						mutable std::mutex mtx;
+						flat_table<key_t> dict;
+						std::vector<std::unique_ptr<key_t[]>> chunks;
+						uint32_t count = 0;
+				};
+
+				std::array<shard, SHARDS> shards;
+
+				static size_t shard_of(const uint64_t hash)
+				{
+						return hash >> (64 - SHARD_BITS);
+				}
+
+				static uint32_t make_id(const size_t sdx, const uint32_t local)
+				{
+						return (local << SHARD_BITS) | sdx;
+				}
+
+		public:
+				intern_table() {}
+				intern_table(const intern_table&) = delete;
+				intern_table& operator=(const intern_table&) = delete;
+
+				/*
+				   @param key - feature representation
+				   @return the id of the feature, a new id if the feature was not seen before
+				 */
+				uint32_t intern(const key_t& key)
+				{
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						const size_t sdx = shard_of(hash);
+						shard& s = shards[sdx];
+
+						std::lock_guard<std::mutex> lock(s.mtx);
+						const entry* item = s.dict.find(key, hash);
+						if(item != nullptr)
+						{
+								return make_id(sdx, item->slot);
+						}
+
+						const uint32_t local = s.count++;
+						assert(local < MAX_LOCAL);
+						if((local & (CHUNK-1)) == 0)
+						{
+								s.chunks.emplace_back(new key_t[CHUNK]);
+						}
+						s.chunks[local >> CHUNK_BITS][local & (CHUNK-1)] = key;
+						s.dict.insert(key, hash).slot = local;
+						return make_id(sdx, local);
+				}
+
+				/*
+				   @param key - feature representation
+				   @return the id of the feature, or NONE if it was never interned
+				 */
+				uint32_t find(const key_t& key) const
+				{
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						const size_t sdx = shard_of(hash);
+						const shard& s = shards[sdx];
+
+						std::lock_guard<std::mutex> lock(s.mtx);
+						const entry* item = s.dict.find(key, hash);
+						return (item == nullptr) ? NONE : make_id(sdx, item->slot);
+				}
+
+				/*
+				   @param id - id returned by intern()
+				   @return the feature for the id
+				 */
+				const key_t& key(const uint32_t id) const
+				{
+						const shard& s = shards[id & (SHARDS-1)];
+						const uint32_t local = id >> SHARD_BITS;
+
+						std::lock_guard<std::mutex> lock(s.mtx);
+						return s.chunks[local >> CHUNK_BITS][local & (CHUNK-1)];
+				}
+
+				/*
+				   Save the features of every shard in id order - new features may be interned concurrently and are included or not
+				   Interned features never change, so only the count and chunk addresses are read under the lock
+				   @param myfile - binary output stream
+				 */
+				void save(std::ostream& myfile) const
+				{
+						std::vector<const key_t*> chunks;
+						for(const shard& s : shards)
+						{
+								uint64_t count;
+								{
+										std::lock_guard<std::mutex> lock(s.mtx);
+										count = s.count;
+										chunks.clear();
+										for(const auto& chunk : s.chunks)
+										{
+												chunks.push_back(chunk.get());
+										}
+								}
+
+								myfile.write((const char*) &count, sizeof(count));
+								for(size_t chunk = 0; chunk < chunks.size(); ++chunk)
+								{
+										const size_t bytes = std::min(CHUNK, (size_t) count - chunk * CHUNK) * sizeof(key_t);
+										myfile.write((const char*) chunks[chunk], bytes);
+								}
+						}
+				}
+
+				/*
+				   Load the features written by save() into an empty table - interning them in the same order restores the same ids
+				   @param myfile - binary input stream
+				   @return true if every shard was read
+				 */
+				bool load(std::istream& myfile)
+				{
+						for(size_t sdx = 0; sdx < SHARDS; ++sdx)
+						{
+								uint64_t count;
+								if(!myfile.read((char*) &count, sizeof(count)))
+								{
+										return false;
+								}
+
+								std::vector<key_t> keys(count);
+								if(!myfile.read((char*) keys.data(), sizeof(key_t) * count))
+								{
+										return false;
+								}
+
+								for(size_t local = 0; local < count; ++local)
+								{
+										if(intern(keys[local]) != make_id(sdx, local))
+										{
+												return false;
+										}
+								}
+						}
+						return true;
+				}
+
+				/*
+				   @return number of distinct features
+				 */
+				size_t size() const
+				{
+						size_t result = 0;
+						for(const shard& s : shards)
+						{
+								result += s.count;
+						}
+						return result;
+				}
+
+				/*
+				   @return bytes allocated for the dictionaries and key chunks
+				 */
+				size_t memory() const
+				{
+						size_t result = 0;
+						for(const shard& s : shards)
+						{
+								result += s.dict.capacity() * sizeof(entry);
+								result += s.chunks.size() * CHUNK * sizeof(key_t);
+						}
+						return result;
+				}
+};
+
+#endif // CMS_ML_INTERN_TABLE_H_
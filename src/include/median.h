@@ -0,0 +1,135 @@
+#ifndef CMS_ML_MEDIAN_H_
+#define CMS_ML_MEDIAN_H_
+
+#include <stddef.h>
+#include <array>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include "simd.h"
+
+/*
+   Sorting Network Medians - The median of the N Count-Sketch rows without allocation or branches
+   Batcher's odd-even merge network works for any N - N = 1, 3, 5, 7 use 0, 3, 9, 16 comparators
+   The comparators are enumerated at compile time and expanded into straight-line min / max instructions,
+   and only the middle outputs are returned, so the compiler removes the comparators that do not reach them
+   The values are sorted in place
+ */
+
+/*
+   Walk the loops of the network - for(p = 1; p < N; p *= 2) for(k = p; k >= 1; k /= 2) for(j = k % p; j + k < N; j += 2k) for(i < k)
+   @param m - number of comparators to skip
+   @return the m-th comparator as (low << 16) | high, or the number of comparators when counting
+ */
+constexpr size_t batcher(const size_t N, const size_t m, const bool count, const size_t p = 1, const size_t k = 1, const size_t j = 0, const size_t i = 0)
+{
+		return (p >= N) ? (count ? 0 : N) :
+				(k == 0) ? batcher(N, m, count, 2*p, 2*p, 0, 0) :
+				(j + k >= N) ? batcher(N, m, count, p, k/2, (k/2) % p, 0) :
+				(i >= k || i + j + k >= N) ? batcher(N, m, count, p, k, j + 2*k, 0) :
+				((i + j) / (2*p) != (i + j + k) / (2*p)) ? batcher(N, m, count, p, k, j, i + 1) :
+				count ? 1 + batcher(N, m, count, p, k, j, i + 1) :
+				(m > 0) ? batcher(N, m - 1, count, p, k, j, i + 1) :
+				((i + j) << 16) | (i + j + k);
+}
+
+// Compare-Exchange M of the N-input network
+template<size_t N, size_t M>
+struct comparator
+{
+		static const size_t LO = batcher(N, M, false) >> 16;
+		static const size_t HI = batcher(N, M, false) & 0xffff;
+};
+
+template<size_t... M>
+struct sequence {};
+
+template<size_t M, size_t... S>
+struct make_sequence : make_sequence<M-1, M-1, S...> {};
+
+template<size_t... S>
+struct make_sequence<0, S...>
+{
+		typedef sequence<S...> type;
+};
+
+// Comparator indices for the N-input network
+template<size_t N>
+using network = typename make_sequence<batcher(N, 0, true)>::type;
+
+// Compare-Exchange - a receives the minimum and b the maximum
+inline void exchange(float& a, float& b)
+{
+		const float lo = std::min(a, b);
+		b = std::max(a, b);
+		a = lo;
+}
+
+inline void exchange(__m256& a, __m256& b)
+{
+		const __m256 lo = _mm256_min_ps(a, b);
+		b = _mm256_max_ps(a, b);
+		a = lo;
+}
+
+AVX512_TARGET inline void exchange(__m512& a, __m512& b)
+{
+		const __m512 lo = min512(a, b);
+		b = max512(a, b);
+		a = lo;
+}
+
+template<size_t N, size_t... M>
+inline void sort_network(float* values, sequence<M...>)
+{
+		const int order[] = {0, (exchange(values[comparator<N, M>::LO], values[comparator<N, M>::HI]), 0)...};
+		(void) order;
+}
+
+template<size_t N, size_t... M>
+inline void sort_network(__m256* values, sequence<M...>)
+{
+		const int order[] = {0, (exchange(values[comparator<N, M>::LO], values[comparator<N, M>::HI]), 0)...};
+		(void) order;
+}
+
+template<size_t N, size_t... M>
+AVX512_TARGET inline void sort_network(__m512* values, sequence<M...>)
+{
+		const int order[] = {0, (exchange(values[comparator<N, M>::LO], values[comparator<N, M>::HI]), 0)...};
+		(void) order;
+}
+
+/*
+   @param values - N floats or N vectors of lanes, one per row
+   @return the lane-wise median, the mean of the two middle values for even N
+ */
+template<size_t N>
+inline float median(float* values)
+{
+		sort_network<N>(values, network<N>());
+		return (N % 2 == 0) ? (values[N/2 - 1] + values[N/2]) / 2 : values[N/2];
+}
+
+template<size_t N>
+inline __m256 median(__m256* values)
+{
+		sort_network<N>(values, network<N>());
+		return (N % 2 == 0) ? _mm256_mul_ps(_mm256_add_ps(values[N/2 - 1], values[N/2]), _mm256_set1_ps(0.5f)) : values[N/2];
+}
+
+template<size_t N>
+AVX512_TARGET inline __m512 median(__m512* values)
+{
+		sort_network<N>(values, network<N>());
+		return (N % 2 == 0) ? _mm512_mul_ps(_mm512_add_ps(values[N/2 - 1], values[N/2]), _mm512_set1_ps(0.5f)) : values[N/2];
+}
+
+template<size_t N>
+inline float median(std::array<float, N> values)
+{
+		return median<N>(values.data());
+}
+
+#endif /* CMS_ML_MEDIAN_H_ */
@@ -2,7 +2,12 @@
 #define CMS_ML_MEM_H_
 
 #include "MurmurHash.h"
+#include "hash_family.h"
 #include "util.h"
+#include "table_memory.h"
+#include "checkpoint.h"
+#include "dirty_map.h"
+#include "simd.h"
 
 #include <random>
 #include <climits>
@@ -14,6 +19,11 @@
 
 #include <immintrin.h>
 
+/*
+   Feature Hashing weights
+   @param hash_t - hash family policy (see hash_family.h)
+ */
+template<typename hash_t = murmur3_hash>
 class MEM
 {
 		private:
@@ -29,18 +39,64 @@ class MEM
 				const unsigned SIZE;
 				std::uniform_int_distribution<unsigned> seed_gen;
 				unsigned seed;
+				hash_t hasher;
 
+				table_memory memory;
 				float * data;
 				__m256i mask;
 
+				// Blocks written since the last checkpoint - nullptr unless a checkpointer tracks the weights
+				dirty_map* dirty;
+
+				/*
+				   Record a write of count weights starting at index
+				 */
+				void mark(const size_t index, const size_t count)
+				{
+						if(dirty)
+						{
+								dirty->mark(sizeof(float) * index, sizeof(float) * count);
+						}
+				}
+
+				/*
+				   AVX-512 version of simd_retrieve(hash, logits) - 16 classes per step, the tail uses a mask register
+				 */
+				AVX512_TARGET void retrieve512(const unsigned hash, float* logits) const
+				{
+						const float* row = &data[(size_t) hash * NK];
+						for(unsigned pos = 0; pos < K; pos += AVX512)
+						{
+								const __mmask16 tail = tail_mask(K - pos);
+								__m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(tail, logits + pos), _mm512_maskz_loadu_ps(tail, row + pos));
+								_mm512_mask_storeu_ps(logits + pos, tail, sum);
+						}
+				}
+
+				/*
+				   AVX-512 version of simd_update(hash, gradient, scale)
+				 */
+				AVX512_TARGET void update512(const unsigned hash, const float* gradient, const float scale)
+				{
+						float* row = &data[(size_t) hash * NK];
+						for(unsigned pos = 0; pos < K; pos += AVX512)
+						{
+								const __mmask16 tail = tail_mask(K - pos);
+								__m512 value = _mm512_maskz_loadu_ps(tail, gradient + pos);
+								__m512 result = _mm512_fmadd_ps(_mm512_set1_ps(scale), value, _mm512_maskz_loadu_ps(tail, row + pos));
+								_mm512_mask_storeu_ps(row + pos, tail, result);
+						}
+				}
+
 		public:
 				/*
 				   Initialize Memory and Random Seeds
 
 				   @param _K - Number of classes
 				   @param _D - Number of weights allocated for each class
+				   @param config - page and NUMA policies for the weight memory
 				 */
-				MEM(unsigned _K, unsigned _D) :
+				MEM(unsigned _K, unsigned _D, const mem_config& config = mem_config()) :
 						K(_K),
 						D(_D),
 						DIV(K/AVX),
@@ -49,85 +105,77 @@ class MEM
 						NK(CNT*AVX),
 						SIZE(NK*D),
 						seed_gen(0, UINT_MAX),
-						seed(seed_gen(generator))
+						seed(seed_gen(generator)),
+						hasher(seed),
+						memory(sizeof(float)*SIZE, config)
 						{
-								data = (float*) aligned_alloc(32, sizeof(float)*SIZE);
-
-								// Dynamic Mask
-								mask = _mm256_set1_epi32(0);
-								for(unsigned idx = 0; idx < MOD; ++idx)
-								{
-										mask[idx] = -1;
-								}
+								data = (float*) memory.data();
+								dirty = nullptr;
 
-								// Clear Sketch
-								memset(data, 0, SIZE);
+								// Dynamic Mask - the first MOD float lanes
+								mask = lane_mask(MOD);
 						}
 
-				~MEM()
+				/*
+				   Erase all values
+				 */
+				void clear()
 				{
-						delete [] data;
+						memory.clear();
+						mark(0, SIZE);
 				}
 
 				/*
-				   Erase all values
+				   Record the blocks changed by every update from now on - for incremental checkpoints
+				   @param map - dirty map sized for table_bytes(), or nullptr to stop tracking
 				 */
-				void clear()
+				void track(dirty_map* map)
 				{
-						memset(data, 0, sizeof(float)*SIZE);
+						dirty = map;
 				}
 
 				/*
-				   Initialize memory from a file
-				   @param filename - Weight File
+				   @return the raw weights - for checkpoints
+				 */
+				void* table() const
+				{
+						return data;
+				}
+
+				/*
+				   @return size of the raw weights in bytes
+				 */
+				size_t table_bytes() const
+				{
+						return sizeof(float) * SIZE;
+				}
+
+				/*
+				   Initialize memory from a checkpoint - the seeds are restored and the table is mapped from the file without a copy
+				   @param filename - Checkpoint File written by save()
 				   @return true if successfully loaded weights from file
 				 */
 				bool initialize(const char* filename)
 				{
-						std::string line;
-						std::ifstream myfile;
-						myfile.open (filename);
-						if(!myfile.is_open())
+						checkpoint_reader reader(filename, checkpoint_kind::mem);
+						if(!reader.matches(K, D, 1, SIZE, sizeof(float), hash_t::ID, 0) || !reader.map(memory))
 						{
 								return false;
 						}
-						assert(myfile.is_open());
-
-						// Read Random Seeds
-						getline (myfile, line);
-						seed = std::atol(line.c_str());
-
-						// Read Sketch Values
-						getline (myfile, line);
-						const size_t file_sketch = std::atol(line.c_str());
-						assert(file_sketch == SIZE);
-
-						for(size_t idx = 0; idx < SIZE; ++idx)
-						{
-								getline (myfile, line);
-								data[idx] = std::atof(line.c_str());
-						}
-						myfile.close();
+						seed = reader.file_seeds()[0];
+						hasher = hash_t(seed);
 						return true;
 				}
 
 				/*
-				   Save weights to a file
-				   @param filename - Weight File
+				   Save memory weights to a binary checkpoint
+				   @param filename - Checkpoint File
+				   @return true if the checkpoint was written
 				 */
-				void save(const char* filename) const
+				bool save(const char* filename) const
 				{
-						std::ofstream myfile;
-						myfile.open (filename);
-						assert(myfile.is_open());
-
-						myfile << seed << std::endl;
-						myfile << SIZE << std::endl;
-						for(size_t idx = 0; idx < SIZE; ++idx)
-						{
-								myfile << data[idx] << std::endl;
-						}
-						myfile.close();
+						const checkpoint_header header = make_header(checkpoint_kind::mem, hash_t::ID, 0, sizeof(float), 1, K, D, 1, SIZE);
+						return write_checkpoint(filename, header, &seed, data);
 				}
 
 				/*
@@ -138,6 +186,7 @@ class MEM
 				void update(const unsigned hash, const float value)
 				{
 						data[hash] += value;
+						mark(hash, 1);
 				}
 
 				/*
@@ -157,8 +206,9 @@ class MEM
 				 */
 				void update(const void* key, const int len, float value)
 				{
-						const unsigned hash = MurmurHash3_x86_32 (key, len, seed) % D;
+						const unsigned hash = hasher.bucket(key, len, D);
 						data[hash] = value;
+						mark(hash, 1);
 				}
 
 				/*
@@ -168,7 +218,7 @@ class MEM
 				 */
 				float retrieve(const void* key, const int len) const
 				{
-						const unsigned hash = MurmurHash3_x86_32 (key, len, seed) % D;
+						const unsigned hash = hasher.bucket(key, len, D);
 						return data[hash];
 				}
 
@@ -194,6 +244,7 @@ class MEM
 								__m256 result = _mm256_add_ps(current, value);
 								_mm256_maskstore_ps(&data[idx], mask, result);
 						}
+						mark(idx, AVX);
 				}
 
 				/*
@@ -216,6 +267,58 @@ class MEM
 						}
 				}
 
+				/*
+				   Add the feature's weights for all classes to the logits - For Softmax Regression
+				   Uses 16-wide AVX-512 instructions when the CPU supports them
+				   @param hash - Hash index for the feature
+				   @param logits - logits for all K classes
+				 */
+				void simd_retrieve(const unsigned hash, float* logits) const
+				{
+						if(has_avx512())
+						{
+								retrieve512(hash, logits);
+								return;
+						}
+
+						for(unsigned cdx = 0; cdx < CNT; ++cdx)
+						{
+								float* ptr = logits + cdx * AVX;
+								_mm256_storeu_ps(ptr, _mm256_add_ps(_mm256_loadu_ps(ptr), simd_retrieve(hash, cdx)));
+						}
+				}
+
+				/*
+				   Update the feature for all classes - For Softmax Regression
+				   Uses 16-wide AVX-512 instructions when the CPU supports them
+				   @param hash - Hash index for the feature
+				   @param gradient - gradient for all K classes
+				   @param scale - multiplier for the gradient, e.g. the negative learning rate
+				 */
+				void simd_update(const unsigned hash, const float* gradient, const float scale)
+				{
+						if(has_avx512())
+						{
+								update512(hash, gradient, scale);
+								mark((size_t) hash * NK, NK);
+								return;
+						}
+
+						__m256 scale_avx = _mm256_set1_ps(scale);
+						for(unsigned cdx = 0; cdx < CNT; ++cdx)
+						{
+								simd_update(hash, cdx, _mm256_mul_ps(scale_avx, _mm256_loadu_ps(gradient + cdx * AVX)));
+						}
+				}
+
+				/*
+				   @return a fingerprint of the hash function - identifies compatible cached hash indices
+				 */
+				uint32_t signature() const
+				{
+						return MurmurHash3_x86_32 (&seed, sizeof(unsigned), D ^ hash_t::ID);
+				}
+
 				/*
 				   Precompute the Hash Index for a feature
 				   @param key - pointer to feature representation
@@ -224,7 +327,28 @@ class MEM
 				 */
 				unsigned hash(const void* key, const int len)
 				{
-						return MurmurHash3_x86_32 (key, len, seed) % D;
+						return hasher.bucket(key, len, D);
+				}
+
+				/*
+				   Precompute the Hash Index for many features - LANES keys per batched hash
+				   @param keys - pointers to feature representations
+				   @param len - length of every feature representation
+				   @param result - array to store the cached values
+				   @param count - number of features
+				 */
+				void hash(const void* const* keys, const int len, unsigned* result, const size_t count)
+				{
+						size_t pos = 0;
+						for(; pos + LANES <= count; pos += LANES)
+						{
+								hasher.bucket(keys + pos, len, D, result + pos);
+						}
+
+						for(; pos < count; ++pos)
+						{
+								result[pos] = hash(keys[pos], len);
+						}
 				}
 };
 
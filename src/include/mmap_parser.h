@@ -0,0 +1,217 @@
+#ifndef CMS_ML_MMAP_PARSER_H_
+#define CMS_ML_MMAP_PARSER_H_
+
+#include "fast_parser.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <stddef.h>
+
+/*
+   Token - A feature that points directly into the memory-mapped file
+   The token is not null-terminated and is valid while its parser is alive
+ */
+struct token_t
+{
+		const char* ptr;
+		size_t len;
+};
+
+/*
+   Position - Where an example ends inside its parser's byte range, for resuming training
+   @param part - byte range of the file
+   @param seq - index of the example inside the range, counted from where the parser started
+   @param end - file offset of the next example in the range
+ */
+struct position_t
+{
+		size_t part;
+		size_t seq;
+		size_t end;
+};
+
+/*
+   Row - A span of tokens for one example
+   The tokens live in the parser's buffer and are overwritten by the next read
+ */
+struct row_t
+{
+		const token_t* data;
+		size_t len;
+		position_t where;
+
+		size_t size() const { return len; }
+		const token_t& operator[](size_t idx) const { return data[idx]; }
+		const token_t* begin() const { return data; }
+		const token_t* end() const { return data + len; }
+};
+
+/*
+   Line - One example as a span of the memory-mapped file, including its newline
+   Passed between threads without copying and split into tokens with tokenize()
+   The span is valid while its parser is alive
+ */
+struct line_t
+{
+		const char* ptr;
+		size_t len;
+		position_t where;
+};
+
+/*
+   MMAP Parser - Map the whole file once and tokenize it in place
+   Delimiters are located 32 bytes at a time using AVX2 instructions
+   A parser may own only one byte range of the file, aligned to newlines
+ */
+class mmap_parser
+{
+		private:
+				bool status;
+				size_t count;
+				size_t length;
+				size_t part;
+
+				int fd;
+				void* addr;
+				const char* pos;
+				const char* stop;
+				const char* limit;
+
+				std::vector<token_t> tokens;
+
+				position_t advance();
+
+		public:
+				mmap_parser(const char*, const size_t part = 0, const size_t parts = 1, const size_t from = 0);
+				~mmap_parser();
+
+				bool read(row_t&, const char);
+				bool read(line_t&);
+				size_t size() const;
+				operator bool() const;
+};
+
+/*
+   Parallel Parser - Split one file into newline-aligned byte ranges
+   Each range is tokenized, or only split into lines, by a separate thread
+   Training can resume from a saved file offset in each range - see progress.h
+ */
+class parallel_parser
+{
+		private:
+				std::vector<std::unique_ptr<mmap_parser>> parts;
+				std::atomic<size_t> active;
+
+				static bool next(mmap_parser& p, row_t& row)
+				{
+						return p.read(row, ' ');
+				}
+
+				static bool next(mmap_parser& p, line_t& line)
+				{
+						return p.read(line);
+				}
+
+				template<typename T, typename F>
+				void each(F& callback)
+				{
+						std::vector<std::thread> workers;
+						for(auto& part : parts)
+						{
+								mmap_parser* p = part.get();
+								workers.emplace_back([this, p, &callback]
+								{
+										T item;
+										while(next(*p, item))
+										{
+												callback(item);
+										}
+										--active;
+								});
+						}
+
+						for(auto& worker : workers)
+						{
+								worker.join();
+						}
+				}
+
+		public:
+				/*
+				   @param name - input file
+				   @param threads - number of byte ranges and parser threads
+				   @param from - file offset to start each range at, 0 for the start of the range
+				 */
+				parallel_parser(const char* name, const size_t threads, const std::vector<size_t>& from = std::vector<size_t>()) : active(threads)
+				{
+						for(size_t idx = 0; idx < threads; ++idx)
+						{
+								parts.emplace_back(new mmap_parser(name, idx, threads, (idx < from.size()) ? from[idx] : 0));
+						}
+				}
+
+				/*
+				   Tokenize every range in parallel
+				   @param callback - called with each row; must be thread-safe
+				 */
+				template<typename F>
+				void run(F callback)
+				{
+						each<row_t>(callback);
+				}
+
+				/*
+				   Split every range into lines in parallel - the caller tokenizes each line, e.g. on another thread
+				   @param callback - called with each line; must be thread-safe
+				 */
+				template<typename F>
+				void lines(F callback)
+				{
+						each<line_t>(callback);
+				}
+
+				size_t size() const
+				{
+						size_t count = 0;
+						for(const auto& part : parts)
+						{
+								count += part->size();
+						}
+						return count;
+				}
+
+				operator bool() const
+				{
+						return active > 0;
+				}
+};
+
+/*
+   Split a line into tokens - delimiters are located 32 bytes at a time using AVX2 instructions
+   @param line - example read by mmap_parser
+   @param delimiter - character separating features
+   @param tokens - replaced by the tokens of the line
+ */
+void tokenize(const line_t& line, const char delimiter, std::vector<token_t>& tokens);
+
+/*
+   Bytes of a token for a fixed-length hash - tokens shorter than len are zero padded as in data_t,
+   so the hash never reads the bytes after the token or past the end of the mapping
+   @param token - parsed feature
+   @param len - number of bytes hashed
+   @param pad - len bytes of scratch space, used if the token is shorter
+   @return len bytes representing the token
+ */
+const void* key_bytes(const token_t& token, const size_t len, char* pad);
+
+// Token Conversions
+data_t to_data(const token_t& token);
+int to_int(const token_t& token);
+
+#endif /* CMS_ML_MMAP_PARSER_H_ */
@@ -2,49 +2,211 @@
 #define CMS_ML_MP_QUEUE_H_
 
 #include <vector>
+#include <atomic>
 #include <mutex>
-#include <thread>
+#include <condition_variable>
+#include <utility>
+#include <assert.h>
 
 /*
-   MP_Queue - A queue that supports parallel reading and processing data
-   A thread reads data to fill the queue until it is full
-   A worker thread safely swaps the full queue with an empty queue
+   MP_Queue - A bounded lock-free ring buffer for multiple producers and consumers
+   Producer threads enqueue items until the ring is full
+   A worker thread retrieves a batch of items once FULL items are ready or the producers close the queue
+   Threads only block on a condition variable when the ring is full or the batch is not ready
  */
 template <typename T>
 class mp_queue
 {
 		private:
-				const size_t MAX = 1;
+				struct slot
+				{
+						std::atomic<size_t> sequence;
+						T item;
+				};
+
+				const size_t MAX = 2;
 				const size_t FULL;
+				const size_t CAPACITY;
+				const size_t MASK;
+
+				std::vector<slot> ring;
+				alignas(64) std::atomic<size_t> head;
+				alignas(64) std::atomic<size_t> tail;
+				alignas(64) std::atomic<bool> closed;
+
+				// Blocking waits
 				std::mutex mtx;
-				std::vector<T> q;
+				std::condition_variable not_full;
+				std::condition_variable ready;
+				std::atomic<size_t> waiters;
+
+				static size_t capacity(size_t n)
+				{
+						size_t result = 1;
+						while(result < n)
+						{
+								result <<= 1;
+						}
+						return result;
+				}
+
+				void notify(std::condition_variable& cv)
+				{
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+						if(waiters.load() > 0)
+						{
+								std::lock_guard<std::mutex> lock(mtx);
+								cv.notify_all();
+						}
+				}
+
+				template<typename P>
+				void wait(std::condition_variable& cv, P predicate)
+				{
+						std::unique_lock<std::mutex> lock(mtx);
+						++waiters;
+						cv.wait(lock, predicate);
+						--waiters;
+				}
+
+				bool try_enqueue(T& item)
+				{
+						size_t pos = tail.load(std::memory_order_relaxed);
+						for(;;)
+						{
+								slot& s = ring[pos & MASK];
+								const size_t seq = s.sequence.load(std::memory_order_acquire);
+								const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+								if(diff == 0)
+								{
+										if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+										{
+												s.item = std::move(item);
+												s.sequence.store(pos + 1, std::memory_order_release);
+												return true;
+										}
+								}
+								else if(diff < 0)
+								{
+										return false;
+								}
+								else
+								{
+										pos = tail.load(std::memory_order_relaxed);
+								}
+						}
+				}
+
+				bool try_dequeue(T& item)
+				{
+						size_t pos = head.load(std::memory_order_relaxed);
+						for(;;)
+						{
+								slot& s = ring[pos & MASK];
+								const size_t seq = s.sequence.load(std::memory_order_acquire);
+								const intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+								if(diff == 0)
+								{
+										if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+										{
+												item = std::move(s.item);
+												s.sequence.store(pos + CAPACITY, std::memory_order_release);
+												return true;
+										}
+								}
+								else if(diff < 0)
+								{
+										return false;
+								}
+								else
+								{
+										pos = head.load(std::memory_order_relaxed);
+								}
+						}
+				}
+
+				size_t count() const
+				{
+						const size_t t = tail.load();
+						const size_t h = head.load();
+						return (t > h) ? t - h : 0;
+				}
 
 		public:
-				mp_queue(size_t full_) : FULL(full_) {}
+				mp_queue(size_t full_) :
+						FULL(full_),
+						CAPACITY(capacity(MAX * full_)),
+						MASK(CAPACITY - 1),
+						ring(CAPACITY),
+						head(0),
+						tail(0),
+						closed(false),
+						waiters(0)
+				{
+						for(size_t idx = 0; idx < CAPACITY; ++idx)
+						{
+								ring[idx].sequence.store(idx, std::memory_order_relaxed);
+						}
+				}
 
+				/*
+				   Add an item - blocks while the ring is full
+				   @param item - example to enqueue
+				 */
 				void enqueue(T item)
 				{
-						while(q.size() >= MAX * FULL)
+						while(!try_enqueue(item))
 						{
-								std::this_thread::sleep_for (std::chrono::seconds(1));
+								wait(not_full, [this] { return count() < CAPACITY; });
 						}
 
-						mtx.lock();
-						q.emplace_back(item);
-						mtx.unlock();
+						if(count() >= FULL)
+						{
+								notify(ready);
+						}
+				}
+
+				/*
+				   Signal that the producers are finished - the remaining items form the last batch
+				   A closed queue stays closed, so each pass over a file uses a new queue
+				 */
+				void close()
+				{
+						closed.store(true);
+						notify(ready);
 				}
 
-				void retrieve(std::vector<T>& result)
+				/*
+				   Move up to FULL items into result - blocks until a full batch is ready or the queue is closed
+				   Several workers may retrieve from the same queue
+				   @param result - empty vector to store the batch
+				   @return false if the queue is closed and empty
+				 */
+				bool retrieve(std::vector<T>& result)
 				{
 						assert(result.empty());
-						mtx.lock();
-						std::swap(q, result);
-						mtx.unlock();
+
+						T item;
+						while(result.empty())
+						{
+								wait(ready, [this] { return count() >= FULL || closed.load(); });
+								while(result.size() < FULL && try_dequeue(item))
+								{
+										result.emplace_back(std::move(item));
+								}
+								notify(not_full);
+
+								if(result.empty() && closed.load() && count() == 0)
+								{
+										return false;
+								}
+						}
+						return true;
 				}
 
 				operator bool() const
 				{
-						return !q.empty();
+						return count() > 0;
 				}
 
 				size_t size() const
@@ -54,7 +216,7 @@ class mp_queue
 
 				bool full() const
 				{
-						return q.size() >= FULL;
+						return count() >= FULL;
 				}
 };
 #endif /* CMS_ML_MP_QUEUE_H_ */
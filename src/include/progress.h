@@ -0,0 +1,141 @@
+#ifndef CMS_ML_PROGRESS_H_
+#define CMS_ML_PROGRESS_H_
+
+#include "mmap_parser.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <queue>
+#include <utility>
+#include <functional>
+#include <istream>
+#include <ostream>
+
+/*
+   Training Progress - Where training can resume in the input files, saved with the background checkpoints
+   Each parser range has a watermark, the file offset after which no example was trained yet
+   Examples finish out of order (parallel parsers and hashers), so an example that finishes early is held back
+   until every earlier example of its range finished - a resumed run never skips an example, but may train
+   the few examples that finished early twice
+   Not thread-safe - only used by the consumer thread, between batches
+ */
+class progress
+{
+		private:
+				static const uint64_t MAGIC = 0x53534552474f5250ULL; // "PROGRESS"
+
+				// next - sequence number of the first example not trained yet
+				// offset - file offset of that example, 0 for the start of the range
+				// early - <sequence, end offset> of examples trained before it
+				struct range
+				{
+						size_t next;
+						size_t offset;
+						std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, std::greater<std::pair<size_t, size_t>>> early;
+				};
+
+				size_t file;
+				std::vector<range> ranges;
+
+		public:
+				progress() : file(0) {}
+
+				/*
+				   Start training a file
+				   @param _file - index of the file in the epoch order
+				   @param parts - number of parser ranges
+				   @param from - offset each range starts at, as passed to parallel_parser
+				 */
+				void start(const size_t _file, const size_t parts, const std::vector<size_t>& from = std::vector<size_t>())
+				{
+						file = _file;
+						ranges.clear();
+						ranges.resize(parts);
+						for(size_t idx = 0; idx < parts; ++idx)
+						{
+								ranges[idx].next = 0;
+								ranges[idx].offset = (idx < from.size()) ? from[idx] : 0;
+						}
+				}
+
+				/*
+				   @param where - position of an example whose update finished
+				 */
+				void complete(const position_t& where)
+				{
+						range& r = ranges[where.part];
+						if(where.seq != r.next)
+						{
+								r.early.emplace(where.seq, where.end);
+								return;
+						}
+
+						r.offset = where.end;
+						++r.next;
+						while(!r.early.empty() && r.early.top().first == r.next)
+						{
+								r.offset = r.early.top().second;
+								r.early.pop();
+								++r.next;
+						}
+				}
+
+				/*
+				   @return index of the file being trained
+				 */
+				size_t current() const
+				{
+						return file;
+				}
+
+				/*
+				   @return resume offset of each parser range
+				 */
+				std::vector<size_t> offsets() const
+				{
+						std::vector<size_t> result;
+						for(const range& r : ranges)
+						{
+								result.push_back(r.offset);
+						}
+						return result;
+				}
+
+				/*
+				   @param myfile - binary output stream
+				 */
+				void save(std::ostream& myfile) const
+				{
+						const uint64_t header[3] = {MAGIC, file, ranges.size()};
+						myfile.write((const char*) header, sizeof(header));
+						for(const range& r : ranges)
+						{
+								const uint64_t offset = r.offset;
+								myfile.write((const char*) &offset, sizeof(offset));
+						}
+				}
+
+				/*
+				   @param myfile - binary input stream
+				   @return true if the progress was read
+				 */
+				bool load(std::istream& myfile)
+				{
+						uint64_t header[3];
+						if(!myfile.read((char*) header, sizeof(header)) || header[0] != MAGIC)
+						{
+								return false;
+						}
+
+						std::vector<uint64_t> from(header[2]);
+						if(!myfile.read((char*) from.data(), sizeof(uint64_t) * from.size()))
+						{
+								return false;
+						}
+						start(header[1], from.size(), std::vector<size_t>(from.begin(), from.end()));
+						return true;
+				}
+};
+
+#endif /* CMS_ML_PROGRESS_H_ */
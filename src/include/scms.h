@@ -0,0 +1,242 @@
+#ifndef CMS_ML_SCMS_H_
+#define CMS_ML_SCMS_H_
+
+#include "MurmurHash.h"
+#include "hash_family.h"
+#include "util.h"
+#include "median.h"
+#include "table_memory.h"
+#include "checkpoint.h"
+#include "cms.h"
+
+#include <random>
+#include <climits>
+#include <cstring>
+#include <array>
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+
+/*
+   Scalar Count-Sketch with N rows - A single class, for Logistic Regression
+   Counters are dense N x D floats without the 8-lane padding of CMS
+   Medians are computed on the stack, so update and retrieve never allocate
+   @param hash_t - hash family policy (see hash_family.h)
+ */
+template<size_t N, typename hash_t = murmur3_hash>
+class SCMS
+{
+		private:
+				const size_t D;
+				const size_t SIZE;
+
+				table_memory memory;
+				float * data;
+				uint32_t seeds[N];
+				std::vector<hash_t> hashes;
+
+				/*
+				   Build the hash function for each row from the random seeds
+				 */
+				void seed_hashes()
+				{
+						hashes.clear();
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								hashes.emplace_back(seeds[idx]);
+						}
+				}
+
+				/*
+				   Counter and sign for one row from a single 64-bit hash
+				 */
+				void split(const size_t idx, const uint64_t hash, uint32_t& index, float& sign) const
+				{
+						index = idx * D + hash_t::index(hash, D);
+						sign = ((hash >> 32) & 0x1) ? 1.0 : -1.0;
+				}
+
+		public:
+				/*
+				   Initialize Memory and Random Seeds for Count-Sketch
+
+				   @param _D - Number of counters in each row
+				   @param config - page and NUMA policies for the sketch memory
+				 */
+				SCMS(size_t _D, const mem_config& config = mem_config()) :
+						D(_D),
+						SIZE(N*D),
+						memory(sizeof(float)*SIZE, config)
+						{
+								data = (float*) memory.data();
+
+								// Initialize seeds for universal hashing
+								std::default_random_engine generator;
+								std::uniform_int_distribution<uint32_t> seed_gen(0, UINT_MAX);
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										seeds[idx] = seed_gen(generator);
+								}
+								seed_hashes();
+						}
+
+				/*
+				   Erase all values in the Count-Sketch
+				 */
+				void clear()
+				{
+						memory.clear();
+				}
+
+				/*
+				   Initialize Count-Sketch from a checkpoint - the seeds are restored and the table is mapped from the file without a copy
+				   @param filename - Checkpoint File written by save()
+				   @return true if successfully loaded weights from file
+				 */
+				bool initialize(const char* filename)
+				{
+						checkpoint_reader reader(filename, checkpoint_kind::scms);
+						if(!reader.matches(1, D, N, SIZE, sizeof(float), hash_t::ID, 0) || !reader.map(memory))
+						{
+								return false;
+						}
+						std::copy(reader.file_seeds().begin(), reader.file_seeds().end(), seeds);
+						seed_hashes();
+						return true;
+				}
+
+				/*
+				   Save Count-Sketch weights to a binary checkpoint
+				   @param filename - Checkpoint File
+				   @return true if the checkpoint was written
+				 */
+				bool save(const char* filename) const
+				{
+						const checkpoint_header header = make_header(checkpoint_kind::scms, hash_t::ID, 0, sizeof(float), N, 1, D, N, SIZE);
+						return write_checkpoint(filename, header, seeds, data);
+				}
+
+				/*
+				   Update feature in the Count-Sketch
+				   @param cache - Cached indices and signs for the feature
+				   @param value - Update value for the feature
+				   @return the new value for the feature
+				 */
+				float update(const hc<N>& cache, const float value)
+				{
+						std::array<float, N> values;
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								float& counter = data[cache.hash[idx]];
+								counter += cache.sign[idx] * value;
+								values[idx] = cache.sign[idx] * counter;
+						}
+						return median(values);
+				}
+
+				/*
+				   Get feature in the Count-Sketch
+				   @param cache - Cached indices and signs for the feature
+				   @return the value for the feature
+				 */
+				float retrieve(const hc<N>& cache) const
+				{
+						std::array<float, N> values;
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								values[idx] = cache.sign[idx] * data[cache.hash[idx]];
+						}
+						return median(values);
+				}
+
+				/*
+				   Update feature in the Count-Sketch
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @param value - Update value for the feature
+				   @return the new value for the feature
+				 */
+				float update(const void* key, const int len, float value)
+				{
+						hc<N> cache;
+						hash(key, len, cache);
+						return update(cache, value);
+				}
+
+				/*
+				   Get feature in the Count-Sketch
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @return the value for the feature
+				 */
+				float retrieve(const void* key, const int len) const
+				{
+						std::array<float, N> values;
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								uint32_t index;
+								float sign;
+								split(idx, hashes[idx](key, len), index, sign);
+								values[idx] = sign * data[index];
+						}
+						return median(values);
+				}
+
+				/*
+				   @return a fingerprint of the hash functions - identifies compatible cached hash indices
+				 */
+				uint32_t signature() const
+				{
+						return MurmurHash3_x86_32 (seeds, sizeof(uint32_t) * N, ~(D ^ hash_t::ID));
+				}
+
+				/*
+				   Precompute the Hash Index and Sign
+				   @param key - pointer to feature representation
+				   @param len - length of the feature representation
+				   @param result - struct to store the cached values
+				 */
+				void hash(const void* key, const int len, hc<N>& result)
+				{
+						for(size_t idx = 0; idx < N; ++idx)
+						{
+								uint32_t index;
+								split(idx, hashes[idx](key, len), index, result.sign[idx]);
+								result.hash[idx] = index;
+						}
+				}
+
+				/*
+				   Precompute the Hash Index and Sign for many features - LANES keys per batched hash
+				   @param keys - pointers to feature representations
+				   @param len - length of every feature representation
+				   @param result - array of count structs to store the cached values
+				   @param count - number of features
+				 */
+				void hash(const void* const* keys, const int len, hc<N>* result, const size_t count)
+				{
+						uint64_t values[LANES];
+
+						size_t pos = 0;
+						for(; pos + LANES <= count; pos += LANES)
+						{
+								for(size_t idx = 0; idx < N; ++idx)
+								{
+										hashes[idx](keys + pos, len, values);
+										for(size_t ldx = 0; ldx < LANES; ++ldx)
+										{
+												uint32_t index;
+												split(idx, values[ldx], index, result[pos+ldx].sign[idx]);
+												result[pos+ldx].hash[idx] = index;
+										}
+								}
+						}
+
+						for(; pos < count; ++pos)
+						{
+								hash(keys[pos], len, result[pos]);
+						}
+				}
+};
+
+#endif // CMS_ML_SCMS_H_
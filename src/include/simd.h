@@ -0,0 +1,78 @@
+#ifndef CMS_ML_SIMD_H_
+#define CMS_ML_SIMD_H_
+
+#include <stddef.h>
+#include <immintrin.h>
+
+/*
+   Runtime CPU Dispatch - The binaries are built for AVX2
+   AVX-512 kernels are compiled with a target attribute and selected once by CPUID, so one binary runs on both kinds of nodes
+ */
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw,avx512vl")))
+
+// Number of floats in an AVX-512 register
+const size_t AVX512 = 16;
+
+/*
+   @return true if the CPU supports the AVX-512 kernels
+ */
+inline bool has_avx512()
+{
+		static const bool result = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+		return result;
+}
+
+/*
+   @param len - number of remaining values
+   @return AVX mask selecting the first len float lanes
+ */
+inline __m256i lane_mask(const size_t len)
+{
+		alignas(32) int lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		for(size_t idx = 0; idx < len && idx < 8; ++idx)
+		{
+				lanes[idx] = -1;
+		}
+		return _mm256_load_si256((const __m256i*) lanes);
+}
+
+/*
+   @param len - number of remaining values
+   @return mask register selecting the first len lanes
+ */
+AVX512_TARGET inline __mmask16 tail_mask(const size_t len)
+{
+		return (len >= AVX512) ? (__mmask16) 0xffff : (__mmask16) ((1u << len) - 1);
+}
+
+// Full-mask min / max - the unmasked intrinsics trigger a spurious -Wmaybe-uninitialized in GCC 12
+AVX512_TARGET inline __m512 min512(__m512 a, __m512 b)
+{
+		return _mm512_mask_min_ps(a, 0xffff, a, b);
+}
+
+AVX512_TARGET inline __m512 max512(__m512 a, __m512 b)
+{
+		return _mm512_mask_max_ps(a, 0xffff, a, b);
+}
+
+// Horizontal sum of 16 lanes
+AVX512_TARGET inline float reduce_add512(__m512 x)
+{
+		const __m256d low = _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf, _mm512_castps_pd(x), 0);
+		const __m256d high = _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf, _mm512_castps_pd(x), 1);
+		const __m256 sum = _mm256_add_ps(_mm256_castpd_ps(low), _mm256_castpd_ps(high));
+		float result = 0.0;
+		for(size_t pos = 0; pos < 8; ++pos)
+		{
+				result += sum[pos];
+		}
+		return result;
+}
+
+AVX512_TARGET inline __m512 my_abs(__m512 x)
+{
+		return _mm512_abs_ps(x);
+}
+
+#endif /* CMS_ML_SIMD_H_ */
@@ -0,0 +1,104 @@
+#ifndef CMS_ML_TABLE_MEMORY_H_
+#define CMS_ML_TABLE_MEMORY_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+#include <stddef.h>
+
+// Page backing for a weight table
+enum class page_policy
+{
+		standard,	// 4 KB pages
+		transparent,	// Transparent Huge Pages - madvise(MADV_HUGEPAGE), falls back silently
+		hugetlb		// Explicit 2 MB pages from hugetlbfs - falls back to transparent if none are reserved
+};
+
+// NUMA placement for a weight table
+enum class numa_policy
+{
+		local,		// Pages land on the node of the thread that first touches them
+		interleave,	// Pages are spread round-robin across all memory nodes
+		bind		// Pages are restricted to a single node
+};
+
+/*
+   Memory Config - How a weight table is backed and placed
+   @param pages - page size policy
+   @param numa - NUMA placement policy
+   @param node - memory node for numa_policy::bind
+   @param threads - threads used to first-touch the table (0 = lazy, zero pages are faulted in on demand)
+ */
+struct mem_config
+{
+		page_policy pages;
+		numa_policy numa;
+		int node;
+		size_t threads;
+
+		mem_config(page_policy _pages = page_policy::transparent, numa_policy _numa = numa_policy::local, int _node = 0, size_t _threads = 0) :
+				pages(_pages),
+				numa(_numa),
+				node(_node),
+				threads(_threads)
+		{}
+};
+
+/*
+   Table Memory - Zero-initialized anonymous mapping for the Count-Sketch and Feature Hashing weights
+   Startup is near-instant because untouched pages are never materialized
+   The mapping is aligned to 2 MB so it can be backed by huge pages
+   A checkpoint can be mapped copy-on-write over the table, so loading weights reads pages on demand instead of copying
+ */
+class table_memory
+{
+		private:
+				const mem_config config;
+				size_t length;
+				size_t page;
+				void* addr;
+				bool mapped;
+
+				void advise();
+				void place();
+				void touch(size_t threads);
+
+		public:
+				/*
+				   @param bytes - size of the table
+				   @param _config - page and NUMA policies
+				 */
+				table_memory(size_t bytes, const mem_config& _config = mem_config());
+				~table_memory();
+
+				table_memory(const table_memory&) = delete;
+				table_memory& operator=(const table_memory&) = delete;
+
+				/*
+				   Reset the whole table to zero - pages are returned to the kernel and faulted in again on demand
+				 */
+				void clear();
+
+				/*
+				   Replace the start of the table with a private mapping of a file - writes never reach the file
+				   The file must extend to a page multiple past offset + bytes
+				   @param fd - open file
+				   @param offset - page-aligned position of the table in the file
+				   @param bytes - size of the table in the file
+				   @return true if the file was mapped
+				 */
+				bool map_file(int fd, size_t offset, size_t bytes);
+
+				void* data() const
+				{
+						return addr;
+				}
+
+				size_t size() const
+				{
+						return length;
+				}
+};
+
+#endif /* CMS_ML_TABLE_MEMORY_H_ */
@@ -2,9 +2,12 @@
 #define CMS_ML_TOPK_H_
 
 #include "util.h"
+#include "flat_table.h"
+#include "bloom_filter.h"
+#include "checkpoint.h"
+#include "heap_log.h"
 #include <utility>
 #include <array>
-#include <unordered_map>
 
 #include <algorithm>
 #include <assert.h>
@@ -41,14 +44,65 @@ class TopK
 		private:
 				typedef std::pair<float, int> ftr;
 
+				typedef typename flat_table<key_t>::entry entry;
+
 				// data - memory_index => <weight, ptr>
 				// keys - ptr => feature
-				// dict - feature => memory_index
+				// dict - feature => <value, memory_index>
+				// filter - rejects most features that are not in the heap before the dict lookup
+				// changed - bitmap of the ptrs changed since the last collect(), empty unless tracked
 				std::vector<ftr> data;
 				std::vector<key_t> keys;
-				std::unordered_map<key_t, int> dict;
-				std::unordered_map<key_t, float> fdict;
+				flat_table<key_t> dict;
+				bloom_filter filter;
 				size_t count;
+				std::vector<uint64_t> changed;
+
+				void mark(const size_t ptr)
+				{
+						if(!changed.empty())
+						{
+								changed[ptr / 64] |= 1ULL << (ptr % 64);
+						}
+				}
+
+				/*
+				   Rebuild the filter from the current features - drops evicted keys and makes room for twice as many
+				 */
+				void rebuild()
+				{
+						filter.reset(2 * count);
+						for(size_t idx = 0; idx < count; ++idx)
+						{
+								filter.insert(flat_table<key_t>::hash(keys[idx]));
+						}
+				}
+
+				/*
+				   Add a new feature to the filter and the dict
+				   @return the dict entry, the caller sets the heap slot
+				 */
+				entry& add(const key_t& key, const uint64_t hash, const float value)
+				{
+						if(filter.saturated())
+						{
+								rebuild();
+						}
+						filter.insert(hash);
+
+						entry& result = dict.insert(key, hash);
+						result.value = value;
+						return result;
+				}
+
+				/*
+				   @return the dict entry for the key, or nullptr if the key is not present
+				 */
+				const entry* lookup(const key_t& key) const
+				{
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						return filter.contains(hash) ? dict.find(key, hash) : nullptr;
+				}
 
 		public:
 				TopK() : data(N), keys(N), count(0) {}
@@ -59,7 +113,8 @@ class TopK
 				 */
 				const float operator[] (const key_t& key) const
 				{
-						return (fdict.find(key) == fdict.end()) ? 0.0 : fdict.at(key);
+						const entry* item = lookup(key);
+						return (item == nullptr) ? 0.0 : item->value;
 				}
 
 				/*
@@ -68,7 +123,7 @@ class TopK
 				 */
 				const bool find (const key_t& key) const
 				{
-						return (fdict.find(key) == fdict.end()) ? false : true;
+						return lookup(key) != nullptr;
 				}
 
 				bool full() const
@@ -92,11 +147,14 @@ class TopK
 				void push(const key_t& key, const float value)
 				{
 						float abs_value = my_abs(value);
-						if(dict.find(key) != dict.end())
+						const uint64_t hash = flat_table<key_t>::hash(key);
+						entry* item = filter.contains(hash) ? dict.find(key, hash) : nullptr;
+						if(item != nullptr)
 						{
-								fdict[key] = value;
+								item->value = value;
 
-								int pos = dict[key];
+								int pos = item->slot;
+								mark(data[pos].second);
 								float& current = data[pos].first;
 								bool top = (abs_value >= current * EPS);
 								bool bottom = (abs_value <= current / EPS);
@@ -115,8 +173,8 @@ class TopK
 								data[count].first = abs_value;
 								data[count].second = count;
 								keys[count] = key;
-								dict[key] = count;
-								fdict[key] = value;
+								add(key, hash, value).slot = count;
+								mark(count);
 								++count;
 
 								// Build Heap
@@ -130,7 +188,7 @@ class TopK
 						}
 						else if(abs_value > (this->minimum() * EPS))
 						{
-								insert(key, value);
+								insert(key, hash, value);
 						}
 						assert(dict.size() <= N);
 				}
@@ -152,8 +210,8 @@ class TopK
 
 								if(current.first < parent.first)
 								{
-										dict[keys[current.second]] = p_idx-1;
-										dict[keys[parent.second]] = idx-1;
+										dict.find(keys[current.second])->slot = p_idx-1;
+										dict.find(keys[parent.second])->slot = idx-1;
 										std::swap(current, parent);
 										heapify(p_idx, true);
 								}
@@ -172,8 +230,8 @@ class TopK
 
 								if(sc.first < current.first)
 								{
-										dict[keys[current.second]] = sc_idx-1;
-										dict[keys[sc.second]] = idx-1;
+										dict.find(keys[current.second])->slot = sc_idx-1;
+										dict.find(keys[sc.second])->slot = idx-1;
 										std::swap(sc, current);
 										heapify(sc_idx, update);
 								}
@@ -183,19 +241,19 @@ class TopK
 				/*
 				   Delete old minimum value and replace with new value
 				   @param key - feature representation
+				   @param hash - hash of the feature for the filter and the dict
 				   @param value - corresponding value for the feature
 				 */
-				void insert(const key_t& key, float value)
+				void insert(const key_t& key, const uint64_t hash, float value)
 				{
 						// Delete Minimum
 						int min_pos = data[0].second;
 						key_t& min_key = keys[min_pos];
 						dict.erase(min_key);
-						fdict.erase(min_key);
+						mark(min_pos);
 
 						min_key = key;
-						dict[key] = 0;
-						fdict[key] = value;
+						add(key, hash, value).slot = 0;
 						data[0].first = my_abs(value);
 						heapify(1);
 				}
@@ -223,52 +281,98 @@ class TopK
 				}
 
 				/*
-				   Load Top-K Heap from file
-				   @param myfile - Top-K Heap File
+				   Load Top-K Heap from a binary checkpoint stream
+				   @param myfile - binary stream, e.g. a Top-K Heap File opened in binary mode
+				   @return true if the heap was read
 				 */
-				void load(std::ifstream& myfile)
+				bool load(std::istream& myfile)
 				{
-						// Read Random Seeds
-						std::string line;
-						getline (myfile, line);
+						return load_heap<key_t>(myfile, *this);
+				}
 
-						const size_t FN = std::atol(line.c_str());
-						for(size_t idx = 0; idx < FN; ++idx)
-						{
-								getline (myfile, line);
+				/*
+				   Save Top-K Heap to a binary checkpoint stream
+				   @param myfile - binary stream, e.g. a Top-K Heap File opened in binary mode
+				 */
+				void save(std::ostream& myfile) const
+				{
+						save_heap<key_t>(myfile, *this);
+				}
 
-								// Key
-								data_t key;
-								std::strcpy (key.data(), line.c_str());
+				/*
+				   Features are admitted immediately - for the same interface as BatchTopK
+				 */
+				void flush() {}
 
-								// Float Weight
-								getline (myfile, line);
-								float value = std::atof(line.c_str());
+				/*
+				   Features are admitted immediately - for the same interface as BatchTopK
+				 */
+				void step() {}
 
-								data[count].first = my_abs(value);
-								data[count].second = count;
-								keys[count] = key;
-								dict[key] = count;
-								fdict[key] = value;
-								++count;
+				/*
+				   No feature is ever buffered - for the same interface as BatchTopK
+				 */
+				template<typename F>
+				void for_each_pending(F func) const {}
+
+				void add_pending(const key_t& key, const float value)
+				{
+						push(key, value);
+				}
+
+				/*
+				   Record the features changed from now on, for incremental checkpoints - the current heap counts as changed
+				 */
+				void track()
+				{
+						changed.assign((N + 63) / 64, 0);
+						for(size_t idx = 0; idx < count; ++idx)
+						{
+								mark(idx);
 						}
 				}
 
 				/*
-				   Save Top-K Heap to file
-				   @param myfile - Top-K Heap File
+				   Copy the features changed since the last call - the checkpoint pause, after track()
+				   A log slot is the position in keys, which does not move when the heap is reordered
+				   @param log - replaced by the changes, applied to a heap_mirror by the checkpointer thread
 				 */
-				void save(std::ofstream& myfile) const
+				void collect(heap_log<key_t>& log)
 				{
-						assert(myfile.is_open());
+						log.size = count;
+						size_t total = 0;
+						for(const uint64_t bits : changed)
+						{
+								total += __builtin_popcountll(bits);
+						}
+						log.changes.clear();
+						log.changes.reserve(total);
+						for(size_t word = 0; word < changed.size(); ++word)
+						{
+								uint64_t bits = changed[word];
+								changed[word] = 0;
+								while(bits)
+								{
+										const uint32_t ptr = word * 64 + __builtin_ctzll(bits);
+										bits &= bits - 1;
+										log.changes.push_back({ptr, keys[ptr], dict.find(keys[ptr])->value});
+								}
+						}
+						log.pending_from = 0;
+						log.pending.clear();
+				}
 
-						myfile << dict.size() << std::endl;
-						for(const auto& item : data)
+				/*
+				   Visit every feature in the Top-K Heap
+				   @param func - called with the key and the signed value of each feature
+				 */
+				template<typename F>
+				void for_each(F func) const
+				{
+						for(size_t idx = 0; idx < count; ++idx)
 						{
-								const key_t& key = keys[item.second];
-								const float value = fdict.at(key);
-								myfile << key << std::endl;
-								myfile << value << std::endl;
+								const key_t& key = keys[data[idx].second];
+								func(key, dict.find(key)->value);
 						}
 				}
 
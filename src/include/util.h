@@ -14,14 +14,22 @@ void replace (__m256* data, size_t idx, float value);
 void update (__m256* data, size_t idx, float value);
 void maximum(__m256* data, size_t len, float& value, uint32_t& argmax);
 void partition(__m256* data, const size_t CNT, const size_t len, const float max_value);
-__m256 median(__m256 a, __m256 b, __m256 c);
+void partition(float* data, const size_t len, const float max_value);
+__m256 exp256(__m256 x);
+
+/*
+   Softmax with cross-entropy loss over the logits of K classes stored in CNT AVX vectors
+   The logits are replaced by the gradient - the class probabilities minus the one-hot label - and the padding lanes are zero
+   @param label - class index for the example
+   @param argmax - predicted class
+   @return log probability of the label
+ */
+float softmax_loss(__m256* logits, const size_t CNT, const size_t K, const size_t label, uint32_t& argmax);
 __m256 my_abs(__m256 x);
 
 // Standard Functions
 void maximum(float* data, size_t len, float& value, uint32_t& argmax);
 float sum(float* data, size_t len);
-float median(float a, float b, float c);
-float median(std::vector<float> values);
 float my_abs(float x);
 
 #endif /* CMS_ML_UTIL_H_ */
@@ -0,0 +1,87 @@
+#include "MurmurHash.h"
+#include "mmap_parser.h"
+#include "feature_key.h"
+#include "frozen_model.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <iostream>
+#include <mutex>
+
+#include <immintrin.h>
+
+/***** Hyper-Parameters *****/
+
+// Number of Classes
+const size_t K = 193;
+
+// Feature Key - must match the trainer that exported the model
+typedef key16_t feature_t;
+
+/***** End of Hyper-Parameters *****/
+
+const size_t AVX = 8;
+const size_t DIV = K / AVX;
+const size_t MOD = K % AVX;
+const size_t CNT = (MOD == 0) ? DIV : DIV+1;
+
+// Number of parser threads splitting the input file
+const size_t PARSERS = 4;
+
+// Serialize Output
+std::mutex mtx;
+
+/*
+   Predict one example with the frozen weights - one lookup and one row addition per feature
+   @param model - frozen model exported by coarse_mission_softmax
+   @param x - label, tag and features of the example
+ */
+void process(const frozen_model<feature_t>& model, const row_t& x)
+{
+		const size_t label = to_int(x[0]) - 1;
+
+		__m256 logits[CNT];
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
+		{
+				logits[cdx] = _mm256_set1_ps(0);
+		}
+
+		for(size_t idx = 2; idx < x.size(); ++idx)
+		{
+				model.retrieve(to_key<feature_t>(x[idx]), (float*) logits);
+		}
+
+		uint32_t argmax = 0;
+		softmax_loss(logits, CNT, K, label, argmax);
+
+		mtx.lock();
+		std::cout << label << " " << argmax << std::endl;
+		mtx.unlock();
+}
+
+/*
+   Serve a frozen model without the sketch or the heaps
+   ./mission_inference <model> <test file> - prints the label and the predicted class of each example
+ */
+int main(int argc, char* argv[])
+{
+		if(argc != 3)
+		{
+				std::cerr << "Usage: " << argv[0] << " <model> <test file>" << std::endl;
+				return 1;
+		}
+
+		frozen_model<feature_t> model;
+		if(!model.load(argv[1]) || model.classes() != K)
+		{
+				std::cerr << "Frozen Model Failure: " << argv[1] << std::endl;
+				return 1;
+		}
+
+		parallel_parser p(argv[2], PARSERS);
+		p.run([&](const row_t& x)
+		{
+				process(model, x);
+		});
+		return 0;
+}
@@ -1,7 +1,7 @@
 #include "MurmurHash.h"
-#include "fast_parser.h"
+#include "mmap_parser.h"
 #include "mp_queue.h"
-#include "cms.h"
+#include "scms.h"
 #include "topk.h"
 
 #include <stdlib.h>
@@ -21,86 +21,74 @@
 // Size of Top-K Heap
 const size_t TOPK = (1 << 14) - 1;
 
-// Number of Classes - Always 1 for Logistic Regression
-const size_t K = 1;
-
 // Size of Count-Sketch Array
-const size_t D = (1 << 18) - 1;
+const size_t D = (1 << 21) - 1;
 
 // Number of Arrays in Count-Sketch
 const size_t N = 3;
 
+// Count-Sketch
+typedef SCMS<N> sketch_t;
+
 // Learning Rate
 const float LR = 5e-1;
 
 /***** End of Hyper-Parameters *****/
 
 typedef std::pair<int, float> fp_t;
-typedef std::pair<int, std::vector<fp_t> > x_t;
+
+// Example as a span of the input file - tokenized and split by the hash stage
+typedef line_t x_t;
 typedef TopK<int, TOPK> tk_t;
 
+// Example with precomputed hash indices - output of the hashing stage
+struct example_t
+{
+		int label;
+		std::vector<fp_t> features;
+		std::vector<hc<N>> cache;
+};
+
 // Serialize Output
 std::mutex mtx;
 
 // Number of threads for parallel data preprocessing
 const size_t THREADS = 2;
+// Number of parser threads splitting each input file
+const size_t PARSERS = 4;
+// Number of threads hashing features between the parsers and the workers
+const size_t HASHERS = 2;
 // Maximum number of features for an example
 const size_t MAX_FEATURES = 5000;
 
-std::array<std::array<hc<N>, MAX_FEATURES>, THREADS> caches;
-
-void split(data_t& item, fp_t& result)
+void split(const token_t& item, fp_t& result)
 {
-		data_t key;
-		data_t value;
-		memset(key.data(), 0, key.size());
-		memset(value.data(), 0, value.size());
-
-		int cdx = 0;
-		for(char v = item[cdx]; v != ':'; v = item[cdx])
-		{
-				key[cdx++] = v;
-		}
-		result.first = atoi(key.data());
+		const char* colon = (const char*) memchr(item.ptr, ':', item.len);
+		const size_t klen = colon - item.ptr;
+		result.first = to_int({item.ptr, klen});
 
-		int initial = ++cdx;
-		for(char v = item[cdx]; v != 0; v = item[cdx])
-		{
-				value[(cdx++ - initial)] = v;
-		}
+		data_t value = to_data({colon+1, item.len - klen - 1});
 		result.second = atof(value.data());
 }
 
-void producer(fast_parser& p, mp_queue<x_t>& q)
+/*
+   Parse Stage - Split the input file into lines
+ */
+void producer(parallel_parser& p, mp_queue<x_t>& q)
 {
-		for(std::vector<data_t> x = p.read(' '); p; x = p.read(' '))
+		p.lines([&](const x_t& line)
 		{
-				const int label = atoi(x[0].data());
-
-				// Parse Features
-				std::vector<fp_t> features(x.size()-1);
-				for(size_t idx = 1; idx < x.size(); ++idx)
-				{
-						split(x[idx], features[idx-1]);
-				}
-
-				q.enqueue(std::make_pair(label, features));
-		}
+				q.enqueue(line);
+		});
+		q.close();
 		//std::cout << "Finished Reading" << std::endl;
 }
 
-float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
+float process(sketch_t& sketch, tk_t& topk, const example_t& x, bool train)
 {
-		float label = (x.first + 1.0f) / 2.0f;
-		const std::vector<fp_t>& features = x.second;
-
-		const int tid = omp_get_thread_num();
-		std::array<hc<N>, MAX_FEATURES>& cache = caches[tid];
-		for(size_t idx = 0; idx < features.size(); ++idx)
-		{
-				const void * key_ptr = (const void *) &features[idx].first;
-				sketch.hash(key_ptr, sizeof(int), cache[idx]);
-		}
+		float label = (x.label + 1.0f) / 2.0f;
+		const std::vector<fp_t>& features = x.features;
+		const std::vector<hc<N>>& cache = x.cache;
 
 		float logit = 0;
 		for(const fp_t& item : features)
@@ -128,20 +116,51 @@ float process(CMS<N>& sketch, tk_t& topk, const x_t& x, bool train)
 		return loss;
 }
 
-void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool train)
+/*
+   Hash Stage - Split each feature into index and value and attach cached hash indices
+ */
+void hasher(sketch_t& sketch, mp_queue<x_t>& rows, mp_queue<example_t>& q)
 {
 		std::vector<x_t> items;
-		size_t cnt = 0;
-		while(p || q)
+		std::vector<token_t> x;
+		std::vector<const void*> key_ptrs;
+		while(rows.retrieve(items))
 		{
-				if(!q.full() && p)
+				for(const x_t& item : items)
 				{
-						std::this_thread::sleep_for (std::chrono::seconds(1));
-						continue;
+						tokenize(item, ' ', x);
+						example_t example;
+						example.label = to_int(x[0]);
+
+						// Parse Features
+						example.features.resize(x.size()-1);
+						for(size_t idx = 1; idx < x.size(); ++idx)
+						{
+								split(x[idx], example.features[idx-1]);
+						}
+						example.cache.resize(example.features.size());
+						key_ptrs.resize(example.features.size());
+						for(size_t idx = 0; idx < example.features.size(); ++idx)
+						{
+								key_ptrs[idx] = (const void *) &example.features[idx].first;
+						}
+						sketch.hash(key_ptrs.data(), sizeof(int), example.cache.data(), key_ptrs.size());
+						q.enqueue(std::move(example));
 				}
+				items.clear();
+		}
+}
 
-				// Retrieve items from multiprocess queue
-				q.retrieve(items);
+/*
+   Train Stage - Only reads and writes the sketch
+ */
+void consumer(sketch_t& sketch, tk_t& topk, mp_queue<example_t>& q, bool train)
+{
+		std::vector<example_t> items;
+		size_t cnt = 0;
+		// Retrieve batches from multiprocess queue until the producers are finished
+		while(q.retrieve(items))
+		{
 				cnt += items.size();
 				float loss = 0.0;
 				for(size_t cdx = 0; cdx < items.size(); ++cdx)
@@ -160,23 +179,40 @@ void consumer(CMS<N>& sketch, tk_t& topk, fast_parser& p, mp_queue<x_t>& q, bool
 		//std::cout << "Finished Consumer" << std::endl;
 }
 
+/*
+   Parse -> Hash -> Train pipeline over one file
+   @param filename - VW data file
+ */
+void pipeline(sketch_t& sketch, tk_t& topk, const char* filename, bool train)
+{
+		parallel_parser p(filename, PARSERS);
+		mp_queue<x_t> rows(1000);
+		mp_queue<example_t> q(10000);
+
+		std::thread pr([&] { producer(p, rows); });
+		std::vector<std::thread> hr;
+		for(size_t idx = 0; idx < HASHERS; ++idx)
+		{
+				hr.emplace_back([&] { hasher(sketch, rows, q); });
+		}
+		std::thread cr([&] { consumer(sketch, topk, q, train); });
+
+		pr.join();
+		for(auto& worker : hr)
+		{
+				worker.join();
+		}
+		q.close();
+		cr.join();
+}
+
 int main(int argc, char* argv[])
 {
-		CMS<N> sketch(K, D);
-		mp_queue<x_t> q(10000);
+		sketch_t sketch(D);
 		tk_t topk;
 
-		fast_parser train_p(argv[1]);
-		std::thread train_pr([&] { producer(train_p, q); });
-		std::thread train_cr([&] { consumer(sketch, topk, train_p, q, true); });
-		train_pr.join();
-		train_cr.join();
-
-		fast_parser test_p(argv[2]);
-		std::thread test_pr([&] { producer(test_p, q); });
-		std::thread test_cr([&] { consumer(sketch, topk, test_p, q, false); });
-		test_pr.join();
-		test_cr.join();
+		pipeline(sketch, topk, argv[1], true);
+		pipeline(sketch, topk, argv[2], false);
 
 		return 0;
 }
@@ -0,0 +1,243 @@
+#include "mmap_parser.h"
+
+#include <sys/stat.h>
+#include <immintrin.h>
+#include <algorithm>
+
+/*
+   @param name - input file
+   @param part - index of the byte range handled by this parser
+   @param parts - number of byte ranges the file is split into
+   @param from - resume at this file offset, a position_t::end saved earlier - ignored unless past the start of the range
+ */
+mmap_parser::mmap_parser(const char* name, const size_t _part, const size_t parts, const size_t from) : status(true), count(0), length(0), part(_part), addr(nullptr), pos(nullptr), stop(nullptr), limit(nullptr)
+{
+		fd = open(name, O_RDONLY);
+
+		struct stat sb;
+		if(fd < 0 || fstat(fd, &sb) != 0 || sb.st_size == 0)
+		{
+				status = false;
+				return;
+		}
+		length = sb.st_size;
+
+		addr = mmap(NULL, length, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED)
+		{
+				std::cout << "MMAP Failure" << std::endl;
+				addr = nullptr;
+				status = false;
+				return;
+		}
+
+		const char* base = reinterpret_cast<const char*>(addr);
+		const size_t begin = length * part / parts;
+		const size_t end = length * (part+1) / parts;
+		pos = base + begin;
+		stop = base + end;
+		limit = base + length;
+
+		// A saved offset is always the start of an example
+		// An example that straddles the boundary belongs to the previous range
+		if(from > begin)
+		{
+				pos = base + std::min(from, length);
+		}
+		else if(begin > 0 && *(pos-1) != '\n')
+		{
+				const void* newline = memchr(pos, '\n', limit - pos);
+				pos = (newline) ? reinterpret_cast<const char*>(newline) + 1 : limit;
+		}
+
+		const size_t pg_size = sysconf(_SC_PAGE_SIZE);
+		const size_t first = (begin / pg_size) * pg_size;
+		// Advice values are not flags - each one is a separate call
+		if(madvise((char*) addr + first, end - first, MADV_SEQUENTIAL) != 0 || madvise((char*) addr + first, end - first, MADV_WILLNEED) != 0)
+		{
+				std::cerr << "Hint Failure" << std::endl;
+		}
+}
+
+mmap_parser::~mmap_parser()
+{
+		if(addr)
+		{
+				munmap(addr, length);
+		}
+
+		if(fd >= 0)
+		{
+				close(fd);
+		}
+}
+
+/*
+   Tokenize from start up to and including the next newline
+   @param start - first byte of the example
+   @param limit - end of the mapping or of the line
+   @param delimiter - character separating features
+   @param tokens - tokens of the example are appended
+   @return the byte after the newline, or limit
+ */
+static const char* scan(const char* start, const char* limit, const char delimiter, std::vector<token_t>& tokens)
+{
+		const __m256i dv = _mm256_set1_epi8(delimiter);
+		const __m256i nv = _mm256_set1_epi8('\n');
+
+		const char* ptr = start;
+
+		// Locate delimiters 32 bytes at a time
+		for(; ptr + 32 <= limit; ptr += 32)
+		{
+				__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+				__m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, dv), _mm256_cmpeq_epi8(chunk, nv));
+				uint32_t mask = _mm256_movemask_epi8(hits);
+				while(mask)
+				{
+						const char* delim = ptr + __builtin_ctz(mask);
+						tokens.push_back({start, (size_t) (delim - start)});
+						start = delim + 1;
+						if(*delim == '\n')
+						{
+								return start;
+						}
+						mask &= mask - 1;
+				}
+		}
+
+		// Remaining bytes at the end
+		for(; ptr < limit; ++ptr)
+		{
+				if(*ptr == delimiter || *ptr == '\n')
+				{
+						tokens.push_back({start, (size_t) (ptr - start)});
+						start = ptr + 1;
+						if(*ptr == '\n')
+						{
+								return start;
+						}
+				}
+		}
+
+		// Last example without a trailing newline
+		if(start < limit)
+		{
+				tokens.push_back({start, (size_t) (limit - start)});
+		}
+		return limit;
+}
+
+/*
+   @return position of the example that ends at pos
+ */
+position_t mmap_parser::advance()
+{
+		return {part, count++, (size_t) (pos - reinterpret_cast<const char*>(addr))};
+}
+
+/*
+   Tokenize the next example
+   @param row - span of tokens for the example
+   @param delimiter - character separating features
+   @return false if there are no more examples
+ */
+bool mmap_parser::read(row_t& row, const char delimiter)
+{
+		tokens.clear();
+		if(!status || pos >= stop)
+		{
+				status = false;
+				return false;
+		}
+
+		pos = scan(pos, limit, delimiter, tokens);
+		if(tokens.empty())
+		{
+				status = false;
+				return false;
+		}
+
+		row.data = tokens.data();
+		row.len = tokens.size();
+		row.where = advance();
+		return true;
+}
+
+/*
+   Find the next example without tokenizing it
+   @param line - span of the example including its newline
+   @return false if there are no more examples
+ */
+bool mmap_parser::read(line_t& line)
+{
+		if(!status || pos >= stop)
+		{
+				status = false;
+				return false;
+		}
+
+		const char* start = pos;
+		const void* newline = memchr(pos, '\n', limit - pos);
+		pos = (newline) ? reinterpret_cast<const char*>(newline) + 1 : limit;
+
+		line.ptr = start;
+		line.len = pos - start;
+		line.where = advance();
+		return true;
+}
+
+void tokenize(const line_t& line, const char delimiter, std::vector<token_t>& tokens)
+{
+		tokens.clear();
+		scan(line.ptr, line.ptr + line.len, delimiter, tokens);
+}
+
+size_t mmap_parser::size() const
+{
+		return this->count;
+}
+
+mmap_parser:: operator bool() const
+{
+		return status;
+}
+
+const void* key_bytes(const token_t& token, const size_t len, char* pad)
+{
+		if(token.len >= len)
+		{
+				return token.ptr;
+		}
+
+		memcpy(pad, token.ptr, token.len);
+		memset(pad + token.len, 0, len - token.len);
+		return pad;
+}
+
+data_t to_data(const token_t& token)
+{
+		data_t buf;
+		memset(buf.data(), 0, buf.size());
+
+		const size_t len = (token.len < buf.size()) ? token.len : buf.size() - 1;
+		memcpy(buf.data(), token.ptr, len);
+		return buf;
+}
+
+int to_int(const token_t& token)
+{
+		size_t idx = 0;
+		bool negative = (token.len > 0 && token.ptr[0] == '-');
+		if(negative || (token.len > 0 && token.ptr[0] == '+'))
+		{
+				++idx;
+		}
+
+		int value = 0;
+		for(; idx < token.len && token.ptr[idx] >= '0' && token.ptr[idx] <= '9'; ++idx)
+		{
+				value = value * 10 + (token.ptr[idx] - '0');
+		}
+		return (negative) ? -value : value;
+}
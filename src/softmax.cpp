@@ -1,6 +1,7 @@
 #include "MurmurHash.h"
-#include "fast_parser.h"
+#include "mmap_parser.h"
 #include "mp_queue.h"
+#include "hash_cache.h"
 #include "mem.h"
 
 #include <stdlib.h>
@@ -34,6 +35,9 @@ const float LR = 1e-2;
 // Length of String Feature Representation
 const size_t LEN = 12;
 
+// Weight Memory
+const mem_config MEMORY(page_policy::transparent, numa_policy::interleave);
+
 /***** End of Hyper-Parameters *****/
 
 // AVX Constants
@@ -43,39 +47,52 @@ const size_t MOD = K % AVX;
 const size_t CNT = (MOD == 0) ? DIV : DIV+1;
 
 typedef std::pair<int, float> fp_t;
-typedef std::vector<data_t> x_t;
+
+// Example as a span of the input file - tokenized by the hash stage
+typedef line_t x_t;
+
+// Example with precomputed hash indices - output of the hashing stage
+struct example_t
+{
+		size_t label;
+		std::vector<unsigned> cache;
+};
 
 // Serialize Output
 std::mutex mtx;
 
 // Number of threads for parallel data preprocessing
 const size_t THREADS = 16;
+// Number of parser threads splitting each input file
+const size_t PARSERS = 4;
+// Number of threads hashing features between the parsers and the workers
+const size_t HASHERS = 4;
 // Maximum number of features for an example
 const size_t MAX_FEATURES = 378;
-std::array<std::array<unsigned, MAX_FEATURES>, THREADS> caches;
 
-void producer(fast_parser& p, mp_queue<x_t>& q)
+/*
+   Parse Stage - Split the input file into lines
+ */
+void producer(parallel_parser& p, mp_queue<x_t>& q)
 {
-		for(std::vector<data_t> x = p.read(' '); p; x = p.read(' '))
+		p.lines([&](const x_t& line)
 		{
-				q.enqueue(x);
-		}
+				q.enqueue(line);
+		});
+		q.close();
 		//std::cout << "Finished Reading" << std::endl;
 }
 
-float process(MEM& sketch, const x_t& x, bool train)
+/*
+   Train or evaluate one example
+   @param label - class index for the example
+   @param cache - cached hash index for each feature
+   @param size - number of features
+ */
+float process(MEM<>& sketch, const size_t label, const unsigned* cache, const size_t size, bool train)
 {
-		const size_t label = atoi(x[0].data()) - 1;
 		assert(label >= 0 && label < K);
-
-		const int tid = omp_get_thread_num();
-		std::array<unsigned, MAX_FEATURES>& cache = caches[tid];
-		for(size_t idx = 2; idx < x.size(); ++idx)
-		{
-				const void * key_ptr = (const void *) x[idx].data();
-				cache[idx-2] = sketch.hash(key_ptr, LEN);
-		}
-		assert(x.size() == MAX_FEATURES+2);
+		assert(size == MAX_FEATURES);
 
 		__m256 logits[CNT];
 		for(size_t cdx = 0; cdx < CNT; ++cdx)
@@ -83,21 +100,14 @@ float process(MEM& sketch, const x_t& x, bool train)
 				logits[cdx] = _mm256_set1_ps(0);
 		}
 
-		for(auto& item : cache)
+		for(size_t idx = 0; idx < size; ++idx)
 		{
-				for(size_t cdx = 0; cdx < CNT; ++cdx)
-				{
-						__m256 weight = sketch.simd_retrieve(item, cdx);
-						logits[cdx] = _mm256_add_ps(logits[cdx], weight);
-				}
+				sketch.simd_retrieve(cache[idx], (float*) logits);
 		}
 
-		float max_value = 0;
+		// Softmax + Cross-Entropy - logits become the gradient
 		uint32_t argmax = 0;
-		maximum(logits, K, max_value, argmax);
-		partition(logits, CNT, K, max_value);
-		float loss = std::log(get(logits, label) + 1e-10);
-		update(logits, label, -1.0);
+		float loss = softmax_loss(logits, CNT, K, label, argmax);
 
 		if(!train)
 		{
@@ -108,32 +118,63 @@ float process(MEM& sketch, const x_t& x, bool train)
 		}
 
 		// Apply Gradient Update
-		__m256 LR_AVX = _mm256_set1_ps(-LR);
-		for(auto& item : cache)
+		for(size_t idx = 0; idx < size; ++idx)
 		{
-				for(size_t cdx = 0; cdx < CNT; ++cdx)
-				{
-						__m256 update = _mm256_mul_ps(LR_AVX, logits[cdx]);
-						sketch.simd_update(item, cdx, update);
-				}
+				sketch.simd_update(cache[idx], (const float*) logits, -LR);
 		}
 		return loss;
 }
 
-void consumer(MEM& sketch, fast_parser& p, mp_queue<x_t>& q, bool train)
+float process(MEM<>& sketch, const example_t& x, bool train)
+{
+		return process(sketch, x.label, x.cache.data(), x.cache.size(), train);
+}
+
+float process(MEM<>& sketch, const cached_example<unsigned>& x, bool train)
+{
+		return process(sketch, x.label, x.features, x.size, train);
+}
+
+/*
+   Hash Stage - Convert tokenized rows into examples with cached hash indices
+ */
+void hasher(MEM<>& sketch, mp_queue<x_t>& rows, mp_queue<example_t>& q)
 {
 		std::vector<x_t> items;
-		size_t cnt = 0;
-		while(p || q)
+		std::vector<token_t> x;
+		std::vector<const void*> key_ptrs;
+		std::vector<char> pad;
+		while(rows.retrieve(items))
 		{
-				if(!q.full() && p)
+				for(const x_t& item : items)
 				{
-						std::this_thread::sleep_for (std::chrono::seconds(1));
-						continue;
+						tokenize(item, ' ', x);
+						example_t example;
+						example.label = to_int(x[0]) - 1;
+						example.cache.resize(x.size()-2);
+						key_ptrs.resize(x.size()-2);
+						pad.resize((x.size()-2) * LEN);
+						for(size_t idx = 2; idx < x.size(); ++idx)
+						{
+								key_ptrs[idx-2] = key_bytes(x[idx], LEN, &pad[(idx-2) * LEN]);
+						}
+						sketch.hash(key_ptrs.data(), LEN, example.cache.data(), key_ptrs.size());
+						q.enqueue(std::move(example));
 				}
+				items.clear();
+		}
+}
 
-				// Retrieve items from multiprocess queue
-				q.retrieve(items);
+/*
+   Train Stage - Only reads and writes the weights
+ */
+void consumer(MEM<>& sketch, mp_queue<example_t>& q, bool train)
+{
+		std::vector<example_t> items;
+		size_t cnt = 0;
+		// Retrieve batches from multiprocess queue until the producers are finished
+		while(q.retrieve(items))
+		{
 				cnt += items.size();
 
 				float loss = 0.0;
@@ -154,31 +195,96 @@ void consumer(MEM& sketch, fast_parser& p, mp_queue<x_t>& q, bool train)
 		//std::cout << "Finished Consumer" << std::endl;
 }
 
+/*
+   Hash every example of a file once and store the result in a binary cache
+   @param input - VW data file
+   @param output - Hash Cache File
+   @return true if the cache was written
+ */
+bool convert(MEM<>& sketch, const char* input, const char* output)
+{
+		hash_cache_writer<unsigned> writer(output, 0, sketch.signature(), input);
+		parallel_parser p(input, PARSERS);
+		p.run([&](const row_t& x)
+		{
+				const size_t size = x.size()-2;
+				std::vector<unsigned> cache(size);
+				std::vector<const void*> key_ptrs(size);
+				std::vector<char> pad(size * LEN);
+				for(size_t idx = 0; idx < size; ++idx)
+				{
+						key_ptrs[idx] = key_bytes(x[idx+2], LEN, &pad[idx * LEN]);
+				}
+				sketch.hash(key_ptrs.data(), LEN, cache.data(), size);
+
+				mtx.lock();
+				writer.write(to_int(x[0]) - 1, cache.data(), nullptr, size);
+				mtx.unlock();
+		});
+		return writer.finish();
+}
+
+/*
+   Parse -> Hash -> Train pipeline over one file
+   @param filename - VW data file
+ */
+void pipeline(MEM<>& sketch, const char* filename, bool train)
+{
+		parallel_parser p(filename, PARSERS);
+		mp_queue<x_t> rows(1000);
+		mp_queue<example_t> q(10000);
+
+		std::thread pr([&] { producer(p, rows); });
+		std::vector<std::thread> hr;
+		for(size_t idx = 0; idx < HASHERS; ++idx)
+		{
+				hr.emplace_back([&] { hasher(sketch, rows, q); });
+		}
+		std::thread cr([&] { consumer(sketch, q, train); });
+
+		pr.join();
+		for(auto& worker : hr)
+		{
+				worker.join();
+		}
+		q.close();
+		cr.join();
+}
+
+void evaluate(MEM<>& sketch, const hash_cache_reader<unsigned>& cache)
+{
+		#pragma omp parallel for
+		for(size_t idx = 0; idx < cache.size(); ++idx)
+		{
+				process(sketch, cache[idx], false);
+		}
+}
+
 int main(int argc, char* argv[])
 {
-		MEM sketch(K, D);
-		mp_queue<x_t> q(10000);
+		MEM<> sketch(K, D, MEMORY);
+
+		// Parse and hash the test file once - every validation pass reads the cache
+		const std::string cache_file = std::string(argv[argc-1]) + ".cache";
+		if(!hash_cache_reader<unsigned>(cache_file.c_str(), 0, sketch.signature(), argv[argc-1]) && !convert(sketch, argv[argc-1], cache_file.c_str()))
+		{
+				std::cerr << "Hash Cache Failure: " << cache_file << std::endl;
+				return 1;
+		}
+		hash_cache_reader<unsigned> test_cache(cache_file.c_str(), 0, sketch.signature(), argv[argc-1]);
 
 		for(int iter = 1; iter < argc-1; ++iter)
 		{
 				std::cout << "Epoch:\t" << iter << std::endl;
 
-				fast_parser train_p(argv[iter]);
-				std::thread train_pr([&] { producer(train_p, q); });
-				std::thread train_cr([&] { consumer(sketch, train_p, q, true); });
-				train_pr.join();
-				train_cr.join();
+				pipeline(sketch, argv[iter], true);
 
 				std::cout << "Validation:\t" << iter << std::endl;
 				std::ofstream out("r" + std::to_string(iter) + ".pred");
 				std::streambuf* coutbuf = std::cout.rdbuf(); //save old buf
 				std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
 
-				fast_parser test_p(argv[argc-1]);
-				std::thread test_pr([&] { producer(test_p, q); });
-				std::thread test_cr([&] { consumer(sketch, test_p, q, false); });
-				test_pr.join();
-				test_cr.join();
+				evaluate(sketch, test_cache);
 
 				std::cout.rdbuf(coutbuf); //redirect std::cout to original
 		}
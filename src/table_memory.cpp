@@ -0,0 +1,240 @@
+#include "table_memory.h"
+
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Huge page size and mapping alignment
+const size_t HUGE_PAGE = 1 << 21;
+
+// Linux memory policy modes - see linux/mempolicy.h
+const int MPOL_BIND_MODE = 2;
+const int MPOL_INTERLEAVE_MODE = 3;
+
+/*
+   @return bitmask of the online memory nodes - parsed from sysfs, e.g. "0-1,4"
+ */
+static std::vector<unsigned long> online_nodes()
+{
+		const size_t BITS = 8 * sizeof(unsigned long);
+		std::vector<unsigned long> mask(1, 0);
+
+		std::string line;
+		std::ifstream myfile("/sys/devices/system/node/online");
+		if(!myfile.is_open() || !getline(myfile, line))
+		{
+				mask[0] = 1;
+				return mask;
+		}
+
+		const char* ptr = line.c_str();
+		while(*ptr)
+		{
+				char* end;
+				const size_t first = strtoul(ptr, &end, 10);
+				size_t last = first;
+				if(*end == '-')
+				{
+						last = strtoul(end+1, &end, 10);
+				}
+
+				for(size_t node = first; node <= last; ++node)
+				{
+						if(node / BITS >= mask.size())
+						{
+								mask.resize(node / BITS + 1, 0);
+						}
+						mask[node / BITS] |= 1UL << (node % BITS);
+				}
+				if(*end != ',')
+				{
+						break;
+				}
+				ptr = end+1;
+		}
+		return mask;
+}
+
+table_memory::table_memory(size_t bytes, const mem_config& _config) : config(_config), length(0), page(sysconf(_SC_PAGE_SIZE)), addr(nullptr), mapped(false)
+{
+		length = ((bytes + HUGE_PAGE - 1) / HUGE_PAGE) * HUGE_PAGE;
+
+		if(config.pages == page_policy::hugetlb)
+		{
+				addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if(addr == MAP_FAILED)
+				{
+						std::cerr << "No hugetlbfs pages available - using transparent huge pages" << std::endl;
+						addr = nullptr;
+				}
+				else
+				{
+						page = HUGE_PAGE;
+				}
+		}
+
+		if(!addr)
+		{
+				// Over-allocate and trim so the table starts on a huge page boundary
+				void* raw = mmap(NULL, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if(raw == MAP_FAILED)
+				{
+						std::cerr << "MMAP Failure" << std::endl;
+						std::abort();
+				}
+
+				const uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+				const uintptr_t aligned = ((begin + HUGE_PAGE - 1) / HUGE_PAGE) * HUGE_PAGE;
+				if(aligned > begin)
+				{
+						munmap(raw, aligned - begin);
+				}
+				munmap(reinterpret_cast<void*>(aligned + length), begin + HUGE_PAGE - aligned);
+				addr = reinterpret_cast<void*>(aligned);
+				advise();
+		}
+
+		place();
+		touch(config.threads);
+}
+
+table_memory::~table_memory()
+{
+		if(addr)
+		{
+				munmap(addr, length);
+		}
+}
+
+/*
+   Ask for transparent huge pages
+ */
+void table_memory::advise()
+{
+		if(config.pages == page_policy::transparent && madvise(addr, length, MADV_HUGEPAGE) != 0)
+		{
+				std::cerr << "Hint Failure" << std::endl;
+		}
+}
+
+/*
+   Apply the NUMA policy before any page is touched
+ */
+void table_memory::place()
+{
+		if(config.numa == numa_policy::local)
+		{
+				return;
+		}
+
+		std::vector<unsigned long> mask;
+		int mode;
+		if(config.numa == numa_policy::interleave)
+		{
+				mask = online_nodes();
+				mode = MPOL_INTERLEAVE_MODE;
+		}
+		else
+		{
+				const size_t BITS = 8 * sizeof(unsigned long);
+				mask.resize(config.node / BITS + 1, 0);
+				mask[config.node / BITS] |= 1UL << (config.node % BITS);
+				mode = MPOL_BIND_MODE;
+		}
+
+		const unsigned long maxnode = 8 * sizeof(unsigned long) * mask.size() + 1;
+		if(syscall(SYS_mbind, addr, length, mode, mask.data(), maxnode, 0) != 0)
+		{
+				std::cerr << "NUMA Policy Failure" << std::endl;
+		}
+}
+
+/*
+   Fault in every page from several threads - with numa_policy::local each thread's range lands on its own node
+   @param threads - number of threads touching the table
+ */
+void table_memory::touch(size_t threads)
+{
+		if(threads == 0)
+		{
+				return;
+		}
+
+		const size_t pages = length / page;
+		char* base = reinterpret_cast<char*>(addr);
+		std::vector<std::thread> workers;
+		for(size_t tdx = 0; tdx < threads; ++tdx)
+		{
+				workers.emplace_back([=]
+				{
+						const size_t first = pages * tdx / threads;
+						const size_t last = pages * (tdx+1) / threads;
+						for(size_t idx = first; idx < last; ++idx)
+						{
+								base[idx * page] = 0;
+						}
+				});
+		}
+
+		for(auto& worker : workers)
+		{
+				worker.join();
+		}
+}
+
+void table_memory::clear()
+{
+		// Dropped pages of a file mapping read back from the file - replace it with anonymous memory again
+		if(mapped)
+		{
+				if(mmap(addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+				{
+						std::cerr << "MMAP Failure" << std::endl;
+						std::abort();
+				}
+				mapped = false;
+				advise();
+				place();
+				touch(config.threads);
+				return;
+		}
+
+		// Private anonymous pages read back as zero after MADV_DONTNEED
+		if(madvise(addr, length, MADV_DONTNEED) != 0)
+		{
+				memset(addr, 0, length);
+				return;
+		}
+		touch(config.threads);
+}
+
+bool table_memory::map_file(int fd, size_t offset, size_t bytes)
+{
+		if(bytes > length || offset % sysconf(_SC_PAGE_SIZE) != 0)
+		{
+				return false;
+		}
+
+		// Huge page mappings cannot be replaced in 4 KB units
+		if(page == HUGE_PAGE)
+		{
+				std::cerr << "File mappings need standard or transparent huge pages" << std::endl;
+				return false;
+		}
+
+		const size_t small = sysconf(_SC_PAGE_SIZE);
+		const size_t span = ((bytes + small - 1) / small) * small;
+		if(mmap(addr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+		{
+				std::cerr << "MMAP Failure" << std::endl;
+				return false;
+		}
+		mapped = true;
+		place();
+		return true;
+}
@@ -1,4 +1,5 @@
 #include "util.h"
+#include "simd.h"
 
 #include <stdio.h>
 #include <cfloat>
@@ -32,7 +33,7 @@ void update (__m256* data, size_t idx, float value)
 
 void maximum(__m256* data, size_t len, float& value, uint32_t& argmax)
 {
-		value = FLT_MIN;
+		value = -FLT_MAX;
 		argmax = 0;
 		for(size_t idx = 0; idx < len; ++idx)
 		{
@@ -45,38 +46,213 @@ void maximum(__m256* data, size_t len, float& value, uint32_t& argmax)
 		}
 }
 
+/*
+   Cephes exp polynomial - 8 lanes, inputs are clamped to the finite float range
+ */
+__m256 exp256(__m256 x)
+{
+		x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+		x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+
+		// exp(x) = 2^n * exp(r) with n = round(x / ln2)
+		__m256 fx = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+
+		__m256 y = _mm256_set1_ps(1.9875691500E-4f);
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507E-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073E-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894E-2f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459E-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201E-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+		// Build 2^n in the exponent field
+		__m256i n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127));
+		return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(n, 23)));
+}
+
+// Horizontal sum and maximum of 8 lanes
+static float hsum(__m256 x)
+{
+		__m128 v = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+		v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+		v = _mm_add_ss(v, _mm_movehdup_ps(v));
+		return _mm_cvtss_f32(v);
+}
+
+static float hmax(__m256 x)
+{
+		__m128 v = _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+		v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+		v = _mm_max_ss(v, _mm_movehdup_ps(v));
+		return _mm_cvtss_f32(v);
+}
+
+float softmax_loss(__m256* logits, const size_t CNT, const size_t K, const size_t label, uint32_t& argmax)
+{
+		const size_t AVX = 8;
+		const __m256 tail = _mm256_castsi256_ps(lane_mask(K - (CNT-1) * AVX));
+
+		// Padding lanes never win the maximum
+		logits[CNT-1] = _mm256_blendv_ps(_mm256_set1_ps(-FLT_MAX), logits[CNT-1], tail);
+
+		// Maximum + Argmax - first class holding the maximum value
+		__m256 vmax = logits[0];
+		for(size_t cdx = 1; cdx < CNT; ++cdx)
+		{
+				vmax = _mm256_max_ps(vmax, logits[cdx]);
+		}
+		const float max_value = hmax(vmax);
+		const __m256 mv = _mm256_set1_ps(max_value);
+
+		argmax = 0;
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
+		{
+				const int hits = _mm256_movemask_ps(_mm256_cmp_ps(logits[cdx], mv, _CMP_EQ_OQ));
+				if(hits)
+				{
+						argmax = cdx * AVX + __builtin_ctz(hits);
+						break;
+				}
+		}
+
+		// Exponentiate + Sum - padding lanes become zero
+		__m256 sum = _mm256_set1_ps(0);
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
+		{
+				logits[cdx] = exp256(_mm256_sub_ps(logits[cdx], mv));
+		}
+		logits[CNT-1] = _mm256_and_ps(logits[CNT-1], tail);
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
+		{
+				sum = _mm256_add_ps(sum, logits[cdx]);
+		}
+
+		// Normalize
+		const __m256 inv = _mm256_set1_ps(1.0f / hsum(sum));
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
+		{
+				logits[cdx] = _mm256_mul_ps(logits[cdx], inv);
+		}
+
+		// Loss and gradient - probabilities minus the one-hot label
+		const float loss = std::log(get(logits, label) + 1e-10);
+		update(logits, label, -1.0);
+		return loss;
+}
+
 void partition(__m256* data, const size_t CNT, const size_t len, const float max_value)
 {
-		// Subtract Maximum Value
+		const size_t AVX = 8;
+		const __m256 tail = _mm256_castsi256_ps(lane_mask(len - (CNT-1) * AVX));
+
+		// Subtract Maximum Value + Exponentiate
 		__m256 mv = _mm256_set1_ps(max_value);
 		for(size_t cdx = 0; cdx < CNT; ++cdx)
 		{
-				data[cdx] = _mm256_sub_ps(data[cdx], mv);
+				data[cdx] = exp256(_mm256_sub_ps(data[cdx], mv));
 		}
+		data[CNT-1] = _mm256_and_ps(data[CNT-1], tail);
 
-		// Exponentiate + Sum
-		float sum = 0.0;
-		for(size_t idx = 0; idx < len; ++idx)
+		// Sum
+		__m256 sum = _mm256_set1_ps(0);
+		for(size_t cdx = 0; cdx < CNT; ++cdx)
 		{
-				float v = std::exp(get(data, idx));
-				sum += v;
-				replace(data, idx, v);
+				sum = _mm256_add_ps(sum, data[cdx]);
 		}
 
 		// Divide by Partition Function
-		__m256 sv = _mm256_set1_ps(sum);
+		__m256 sv = _mm256_set1_ps(hsum(sum));
 		for(size_t cdx = 0; cdx < CNT; ++cdx)
 		{
 				data[cdx] = _mm256_div_ps(data[cdx], sv);
 		}
 }
 
-__m256 median(__m256 a, __m256 b, __m256 c)
+// The masked forms with an explicit source avoid the undefined pass-through operand of the plain intrinsics, as in simd.h
+AVX512_TARGET static __m512 exp512(__m512 x)
+{
+		x = min512(x, _mm512_set1_ps(88.3762626647949f));
+		x = max512(x, _mm512_set1_ps(-88.3762626647949f));
+
+		__m512 fx = _mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504088896341f), _mm512_set1_ps(0.5f));
+		fx = _mm512_mask_roundscale_ps(fx, 0xffff, fx, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+		x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
+
+		__m512 y = _mm512_set1_ps(1.9875691500E-4f);
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507E-3f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073E-3f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894E-2f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459E-1f));
+		y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201E-1f));
+		y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+		__m512i n = _mm512_add_epi32(_mm512_mask_cvttps_epi32(_mm512_setzero_si512(), 0xffff, fx), _mm512_set1_epi32(127));
+		n = _mm512_mask_slli_epi32(n, 0xffff, n, 23);
+		return _mm512_mul_ps(y, _mm512_castsi512_ps(n));
+}
+
+AVX512_TARGET static void partition512(float* data, const size_t len, const float max_value)
+{
+		// Subtract Maximum Value + Exponentiate + Sum
+		__m512 mv = _mm512_set1_ps(max_value);
+		__m512 sum = _mm512_setzero_ps();
+		for(size_t pos = 0; pos < len; pos += AVX512)
+		{
+				const __mmask16 tail = tail_mask(len - pos);
+				__m512 value = _mm512_maskz_mov_ps(tail, exp512(_mm512_sub_ps(_mm512_maskz_loadu_ps(tail, data + pos), mv)));
+				_mm512_mask_storeu_ps(data + pos, tail, value);
+				sum = _mm512_add_ps(sum, value);
+		}
+
+		// Divide by Partition Function
+		__m512 sv = _mm512_set1_ps(reduce_add512(sum));
+		for(size_t pos = 0; pos < len; pos += AVX512)
+		{
+				const __mmask16 tail = tail_mask(len - pos);
+				_mm512_mask_storeu_ps(data + pos, tail, _mm512_div_ps(_mm512_maskz_loadu_ps(tail, data + pos), sv));
+		}
+}
+
+/*
+   Softmax over len contiguous logits - AVX-512 when the CPU supports it
+   Only the first len values are read or written
+ */
+void partition(float* data, const size_t len, const float max_value)
 {
-		__m256 ab_min = _mm256_min_ps(a, b);
-		__m256 ab_max = _mm256_max_ps(a, b);
-		__m256 ab_max_c_min = _mm256_min_ps(ab_max, c);
-		return _mm256_max_ps(ab_min, ab_max_c_min);
+		if(has_avx512())
+		{
+				partition512(data, len, max_value);
+				return;
+		}
+
+		// Mask for the last partial group of 8 values
+		const size_t AVX = 8;
+		const size_t DIV = len / AVX * AVX;
+		const __m256i mask = lane_mask(len - DIV);
+
+		// Subtract Maximum Value + Exponentiate + Sum
+		__m256 mv = _mm256_set1_ps(max_value);
+		__m256 sum = _mm256_set1_ps(0);
+		for(size_t pos = 0; pos < DIV; pos += AVX)
+		{
+				__m256 value = exp256(_mm256_sub_ps(_mm256_loadu_ps(data + pos), mv));
+				_mm256_storeu_ps(data + pos, value);
+				sum = _mm256_add_ps(sum, value);
+		}
+		__m256 value = _mm256_and_ps(exp256(_mm256_sub_ps(_mm256_maskload_ps(data + DIV, mask), mv)), _mm256_castsi256_ps(mask));
+		_mm256_maskstore_ps(data + DIV, mask, value);
+		sum = _mm256_add_ps(sum, value);
+
+		// Divide by Partition Function
+		__m256 sv = _mm256_set1_ps(hsum(sum));
+		for(size_t pos = 0; pos < DIV; pos += AVX)
+		{
+				_mm256_storeu_ps(data + pos, _mm256_div_ps(_mm256_loadu_ps(data + pos), sv));
+		}
+		_mm256_maskstore_ps(data + DIV, mask, _mm256_div_ps(_mm256_maskload_ps(data + DIV, mask), sv));
 }
 
 __m256 my_abs(__m256 x)
@@ -87,7 +263,7 @@ __m256 my_abs(__m256 x)
 
 void maximum(float* data, size_t len, float& value, uint32_t& argmax)
 {
-		value = FLT_MIN;
+		value = -FLT_MAX;
 		argmax = 0;
 		for(size_t idx = 0; idx < len; ++idx)
 		{
@@ -109,26 +285,6 @@ float sum(float* data, size_t len)
 		return value;
 }
 
-float median(float a, float b, float c)
-{
-		return std::max(std::min(a,b), std::min(std::max(a,b),c));
-}
-
-float median(std::vector<float> values)
-{
-		size_t size = values.size();
-		std::sort(values.begin(), values.end());
-
-		if (size % 2 == 0)
-		{
-				return (values[size / 2 - 1] + values[size / 2]) / 2;
-		}
-		else
-		{
-				return values[size / 2];
-		}
-}
-
 float my_abs(float x)
 {
 		return (x >= 0) ? x : -x;